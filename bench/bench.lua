@@ -0,0 +1,388 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-dbus
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-dbus is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-dbus is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Benchmark client, run through bench/run.sh (or 'make bench')
+-- which starts a private dbus-daemon and bench/server.lua.
+--
+-- Every result is written as one JSON object per line to the
+-- file given as the first argument (default bench_output.txt).
+-- Set BENCH_SCALE to shorten or lengthen the runs.
+
+local utils = require 'lem.utils'
+local dbus  = require 'lem.dbus'
+local cases = require 'bench.cases'
+
+local format, concat, sort = string.format, table.concat, table.sort
+local floor, huge = math.floor, math.huge
+local spawn, now = utils.spawn, utils.now
+local marshal, unmarshal = dbus.marshal, dbus.unmarshal
+
+local output = arg[1] or 'bench_output.txt'
+local scale  = tonumber(os.getenv('BENCH_SCALE')) or 1
+local rev    = os.getenv('BENCH_REV')
+
+local service, path, interface = cases.service, cases.path, cases.interface
+local calls = floor(10000 * scale)
+
+-- results
+
+local function quote(s)
+	return '"' .. s:gsub('[%c"\\]', function(c)
+		return format('\\u%04x', c:byte())
+	end) .. '"'
+end
+
+local function encode(t)
+	local keys, l = {}, 0
+	for k in pairs(t) do
+		l = l + 1
+		keys[l] = k
+	end
+	sort(keys)
+
+	for i = 1, l do
+		local k = keys[i]
+		local v = t[k]
+		if type(v) == 'number' then
+			if v ~= v or v == huge or v == -huge then
+				v = 'null'
+			elseif v == floor(v) and v > -2^53 and v < 2^53 then
+				v = format('%d', v)
+			else
+				v = format('%.6g', v)
+			end
+		elseif type(v) ~= 'boolean' then
+			v = quote(tostring(v))
+		end
+		keys[i] = quote(k) .. ':' .. tostring(v)
+	end
+
+	return '{' .. concat(keys, ',') .. '}'
+end
+
+local out = assert(io.open(output, 'w'))
+
+local function record(t)
+	t.rev = rev
+	local line = encode(t)
+	out:write(line, '\n')
+	out:flush()
+	print(line)
+end
+
+-- add latency percentiles for one call key to a result
+local function latency(bus, t, key)
+	local h = bus:latency('call', 50, 90, 99, 99.9)[key]
+	if h then
+		t.mean = h.mean
+		t.p50  = h[50]
+		t.p90  = h[90]
+		t.p99  = h[99]
+		t.p999 = h[99.9]
+		t.max  = h.max
+	end
+	return t
+end
+
+record{
+	bench = 'run',
+	date  = os.date('!%Y-%m-%dT%H:%M:%SZ'),
+	scale = scale,
+	lua   = _VERSION,
+}
+
+local function echo(bus, destination, case)
+	local method, signature = 'Echo' .. case.name, case.signature
+	if signature == '' then
+		return bus:call(destination, path, interface, method)
+	end
+	return bus:call(destination, path, interface, method,
+		signature, case.value)
+end
+
+-- encoding and decoding cost of every payload on its own
+
+for _, case in ipairs(cases) do
+	local n = case.calls and floor(case.calls * scale) or calls
+	local signature, value = case.signature, case.value
+
+	local ok, bytes = pcall(marshal, signature, value)
+	if not ok then
+		record{
+			bench     = 'marshal',
+			case      = case.name,
+			signature = signature,
+			skipped   = bytes,
+		}
+	else
+		local start = os.clock()
+		for _ = 1, n do marshal(signature, value) end
+		local encode = os.clock() - start
+
+		start = os.clock()
+		for _ = 1, n do unmarshal(bytes) end
+		local decode = os.clock() - start
+
+		record{
+			bench     = 'marshal',
+			case      = case.name,
+			signature = signature,
+			bytes     = #bytes,
+			calls     = n,
+			encode    = encode / n,
+			decode    = decode / n,
+		}
+	end
+end
+
+-- call round-trip over a pair() without any bus daemon,
+-- this is the cost of the module and libdbus on their own
+
+do
+	local client, server = assert(dbus.pair())
+	local obj = dbus.newobject(path)
+
+	cases.addechoes(obj)
+	assert(server:registerobject(obj))
+	spawn(function() server:listen() end)
+
+	for _, case in ipairs(cases) do
+		if pcall(marshal, case.signature, case.value) then
+			local n = case.calls and floor(case.calls * scale) or calls
+
+			echo(client, nil, case) -- warm up
+			client:resetlatency()
+			local start = now()
+			for _ = 1, n do
+				local _, err = echo(client, nil, case)
+				if err then error(err) end
+			end
+			local elapsed = now() - start
+
+			record(latency(client, {
+				bench     = 'pair',
+				case      = case.name,
+				signature = case.signature,
+				calls     = n,
+				seconds   = elapsed,
+				rate      = n / elapsed,
+			}, '\n' .. interface .. '\nEcho' .. case.name))
+		end
+	end
+
+	server:interrupt()
+	client:close()
+	server:close()
+end
+
+-- connect and wait for the server to claim its name
+
+local bus, name = assert(dbus.session())
+
+do
+	local sleeper = utils.newsleeper()
+	local deadline = now() + 10
+	while not bus:call(dbus.SERVICE_DBUS, dbus.PATH_DBUS, dbus.INTERFACE_DBUS,
+			'NameHasOwner', 's', service) do
+		if now() > deadline then error('benchmark server did not start') end
+		sleeper:sleep(0.05)
+	end
+end
+
+-- call round-trip for every payload, the payload is
+-- encoded and decoded twice per call, once in each end
+
+local base
+local percall = {}
+
+for _, case in ipairs(cases) do
+	local n = case.calls and floor(case.calls * scale) or calls
+
+	-- find out if the payload can be encoded at all
+	local ok, err = pcall(marshal, case.signature, case.value)
+	if not ok then
+		record{
+			bench     = 'echo',
+			case      = case.name,
+			signature = case.signature,
+			skipped   = err,
+		}
+	else
+		echo(bus, service, case) -- warm up
+		bus:resetlatency()
+		local start = now()
+		for _ = 1, n do
+			local _, err = echo(bus, service, case)
+			if err then error(err) end
+		end
+		local elapsed = now() - start
+
+		if base == nil then base = elapsed / n end
+		percall[case.name] = elapsed / n
+
+		record(latency(bus, {
+			bench     = 'echo',
+			case      = case.name,
+			signature = case.signature,
+			calls     = n,
+			seconds   = elapsed,
+			rate      = n / elapsed,
+			extra     = elapsed / n - base,
+		}, service .. '\n' .. interface .. '\nEcho' .. case.name))
+	end
+end
+
+-- call round-trip for every payload through a Pool, extra
+-- is the cost over making the same call on a Bus directly
+
+do
+	local pool = assert(dbus.newpool(nil, 4))
+
+	for _, case in ipairs(cases) do
+		local n = case.calls and floor(case.calls * scale) or calls
+
+		if percall[case.name] then
+			echo(pool, service, case) -- warm up
+			local start = now()
+			for _ = 1, n do
+				local _, err = echo(pool, service, case)
+				if err then error(err) end
+			end
+			local elapsed = now() - start
+
+			record{
+				bench     = 'pool',
+				case      = case.name,
+				signature = case.signature,
+				calls     = n,
+				seconds   = elapsed,
+				rate      = n / elapsed,
+				extra     = elapsed / n - percall[case.name],
+			}
+		end
+	end
+
+	pool:close()
+end
+
+-- decoding a{sv} as sent by the daemon itself
+
+do
+	local key = dbus.SERVICE_DBUS .. '\n' .. dbus.INTERFACE_DBUS ..
+		'\nGetConnectionCredentials'
+
+	bus:resetlatency()
+	local start = now()
+	for _ = 1, calls do
+		local _, err = bus:call(dbus.SERVICE_DBUS, dbus.PATH_DBUS,
+			dbus.INTERFACE_DBUS, 'GetConnectionCredentials', 's', name)
+		if err then error(err) end
+	end
+	local elapsed = now() - start
+
+	record(latency(bus, {
+		bench     = 'decode',
+		case      = 'Credentials',
+		signature = 'a{sv}',
+		calls     = calls,
+		seconds   = elapsed,
+		rate      = calls / elapsed,
+	}, key))
+end
+
+-- method server capacity with a number of concurrent callers
+
+for _, workers in ipairs{ 1, 4, 16, 64 } do
+	local sleeper = utils.newsleeper()
+	local count, errors, done = 0, 0, 0
+	local start = now()
+	local deadline = start + 2 * scale
+
+	bus:resetlatency()
+	for _ = 1, workers do
+		spawn(function()
+			while now() < deadline do
+				local _, err = bus:call(service, path, interface, 'EchoEmpty')
+				if err then
+					errors = errors + 1
+				else
+					count = count + 1
+				end
+			end
+			done = done + 1
+			if done == workers then sleeper:wakeup() end
+		end)
+	end
+	sleeper:sleep()
+	local elapsed = now() - start
+
+	record(latency(bus, {
+		bench   = 'capacity',
+		workers = workers,
+		calls   = count,
+		errors  = errors,
+		seconds = elapsed,
+		rate    = count / elapsed,
+	}, service .. '\n' .. interface .. '\nEchoEmpty'))
+end
+
+-- signal fan-out from the server to a number of subscribers
+
+for _, subscribers in ipairs{ 1, 4, 16 } do
+	local sleeper = utils.newsleeper()
+	local expected, delivered = subscribers * calls, 0
+	local subs = {}
+
+	for i = 1, subscribers do
+		local sub = assert(dbus.session())
+		assert(sub:registersignal(path, interface, 'Tick', function()
+			delivered = delivered + 1
+			if delivered == expected then sleeper:wakeup() end
+		end))
+		spawn(function() sub:listen() end)
+		subs[i] = sub
+	end
+
+	local start = now()
+	local _, err = bus:call(service, path, interface, 'Emit', 'us',
+		calls, ('x'):rep(64))
+	if err then error(err) end
+	if delivered < expected then sleeper:sleep(30 * scale + 10) end
+	local elapsed = now() - start
+
+	for i = 1, subscribers do
+		subs[i]:interrupt()
+		subs[i]:close()
+	end
+
+	record{
+		bench       = 'fanout',
+		subscribers = subscribers,
+		signals     = calls,
+		delivered   = delivered,
+		seconds     = elapsed,
+		rate        = delivered / elapsed,
+	}
+end
+
+bus:call(service, path, interface, 'Quit')
+bus:close()
+out:close()
+
+-- vim: syntax=lua ts=2 sw=2 noet:
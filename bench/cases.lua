@@ -0,0 +1,58 @@
+--
+-- This file is part of lem-dbus
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-dbus is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-dbus is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Payloads shared by the benchmark client and server.
+-- Every case becomes an Echo<name> method on the server
+-- which returns its arguments unchanged. Cases with a calls
+-- field are run that many times instead of the default.
+
+local bytes = {}
+for i = 1, 65536 do bytes[i] = i % 256 end
+
+local structs = {}
+for i = 1, 16 do
+	structs[i] = { 'item' .. i, { { i, i * 2 }, { -i, i * 3 } } }
+end
+
+local M = {
+	service   = 'org.lem.dbus.Bench',
+	path      = '/org/lem/dbus/Bench',
+	interface = 'org.lem.dbus.Bench',
+
+	{ name = 'Empty',  signature = '' },
+	{ name = 'String', signature = 's', value = ('x'):rep(64) },
+	{ name = 'Dict',   signature = 'a{sv}',
+		value = { name = 'bench', count = 42, enabled = true } },
+	{ name = 'Bytes',  signature = 'ay', value = bytes, calls = 1000 },
+	{ name = 'Struct', signature = 'a(sa(iu))', value = structs },
+}
+
+-- add the Echo<name> methods to an exported object
+function M.addechoes(obj)
+	for _, case in ipairs(M) do
+		local signature = case.signature
+		obj:addmethod(M.interface, 'Echo' .. case.name, signature, signature,
+		function(...)
+			return signature, ...
+		end)
+	end
+end
+
+return M
+
+-- vim: syntax=lua ts=2 sw=2 noet:
@@ -0,0 +1,53 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-dbus
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-dbus is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-dbus is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Replay a capture file written by Bus:capture() against
+-- a server on the session bus.
+--
+-- usage: replay.lua <file> [rate] [destination] [direction]
+--
+-- rate is 'original', 'max' or a speed factor,
+-- direction is 'in' (messages the captured bus received)
+-- or 'out' (messages it sent).
+
+local utils = require 'lem.utils'
+local dbus  = require 'lem.dbus'
+
+local filename = arg[1]
+if not filename then
+	io.stderr:write('usage: ', arg[0], ' <file> [rate] [destination] [direction]\n')
+	utils.exit(1)
+end
+
+local bus = assert(dbus.session())
+
+local start = utils.now()
+local sent = assert(bus:replay(filename, {
+	rate        = arg[2],
+	destination = arg[3],
+	direction   = arg[4],
+}))
+local elapsed = utils.now() - start
+
+print(('replayed %d messages in %.3fs (%.0f/s)'):format(
+	sent, elapsed, sent / elapsed))
+
+bus:close()
+
+-- vim: syntax=lua ts=2 sw=2 noet:
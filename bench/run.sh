@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+# This file is part of lem-dbus
+# Copyright 2011 Emil Renner Berthing
+#
+# lem-dbus is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+# lem-dbus is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Run the benchmarks against a private dbus-daemon so results
+# don't depend on whatever else is using the session bus.
+#
+# usage: bench/run.sh [output file]
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+output=${1:-bench_output.txt}
+LEM=${LEM:-lem}
+DBUS_DAEMON=${DBUS_DAEMON:-dbus-daemon}
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/lem-dbus-bench.XXXXXX")
+daemon=
+server=
+
+cleanup() {
+	[ -n "$server" ] && kill "$server" 2>/dev/null
+	[ -n "$daemon" ] && kill "$daemon" 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$dir/bus.conf" <<CONF
+<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>session</type>
+  <listen>unix:path=$dir/socket</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow send_destination="*" eavesdrop="true"/>
+    <allow eavesdrop="true"/>
+    <allow own="*"/>
+  </policy>
+  <limit name="max_incoming_bytes">1000000000</limit>
+  <limit name="max_outgoing_bytes">1000000000</limit>
+  <limit name="max_message_size">1000000000</limit>
+  <limit name="max_replies_per_connection">50000</limit>
+  <limit name="max_match_rules_per_connection">50000</limit>
+</busconfig>
+CONF
+
+"$DBUS_DAEMON" --config-file="$dir/bus.conf" --nofork &
+daemon=$!
+
+i=0
+while [ ! -S "$dir/socket" ]; do
+	i=$((i + 1))
+	if [ $i -gt 100 ]; then
+		echo "dbus-daemon did not start" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+DBUS_SESSION_BUS_ADDRESS="unix:path=$dir/socket"
+LUA_PATH="$top/?.lua;${LUA_PATH:-;}"
+LUA_CPATH="$top/?.so;${LUA_CPATH:-;}"
+BENCH_REV=$(git -C "$top" describe --always --dirty 2>/dev/null || true)
+export DBUS_SESSION_BUS_ADDRESS LUA_PATH LUA_CPATH BENCH_REV
+
+"$LEM" "$top/bench/server.lua" &
+server=$!
+
+"$LEM" "$top/bench/bench.lua" "$output"
+
+wait "$server"
+server=
@@ -0,0 +1,51 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-dbus
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-dbus is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-dbus is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Method server for bench/bench.lua, started by bench/run.sh
+-- on a private bus.
+
+local dbus  = require 'lem.dbus'
+local cases = require 'bench.cases'
+
+local bus = assert(dbus.session())
+
+assert(assert(bus:RequestName(cases.service, dbus.NAME_FLAG_DO_NOT_QUEUE))
+	== dbus.REQUEST_NAME_REPLY_PRIMARY_OWNER, 'benchmark service already running')
+
+local obj = dbus.newobject(cases.path)
+
+cases.addechoes(obj)
+
+-- emits n Tick signals for the fan-out benchmark
+obj:addmethod(cases.interface, 'Emit', 'us', '', function(n, s)
+	for i = 1, n do
+		bus:signal(cases.path, cases.interface, 'Tick', 's', s)
+	end
+end)
+
+obj:addmethod(cases.interface, 'Quit', '', '', function()
+	bus:interrupt()
+end)
+
+assert(bus:registerobject(obj))
+
+local ok, err = bus:listen()
+if not ok and err ~= 'interrupted' then error(err) end
+
+-- vim: syntax=lua ts=2 sw=2 noet:
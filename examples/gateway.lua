@@ -0,0 +1,56 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-dbus
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-dbus is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-dbus is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Relay every method call made to a name on the session bus
+-- to a service on the system bus, without decoding them.
+--
+-- usage: gateway.lua <session name> <system service>
+--
+-- eg. gateway.lua org.lua.Gateway org.freedesktop.DBus
+
+local utils = require 'lem.utils'
+local dbus  = require 'lem.dbus'
+
+local name, service = arg[1], arg[2]
+if not service then
+	io.stderr:write('usage: ', arg[0], ' <session name> <system service>\n')
+	utils.exit(1)
+end
+
+local session = assert(dbus.session())
+local system  = assert(dbus.system())
+
+if assert(session:RequestName(name, dbus.NAME_FLAG_DO_NOT_QUEUE))
+		~= dbus.REQUEST_NAME_REPLY_PRIMARY_OWNER then
+	error("couldn't get the name " .. name)
+end
+
+-- the reply from the system bus is sent back
+-- to the caller on the session bus by forward()
+assert(session:registerraw(nil, function(msg)
+	local ok, err = system:forward(msg, service)
+	if not ok then
+		msg:error('org.freedesktop.DBus.Error.Failed', err)
+	end
+end))
+
+local ok, err = session:listen()
+if not ok and err ~= 'interrupted' then error(err) end
+
+-- vim: syntax=lua ts=2 sw=2 noet:
@@ -0,0 +1,37 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-dbus
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-dbus is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-dbus is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Print the messages passing through the session bus,
+-- optionally only those for a given interface.
+--
+-- usage: monitor.lua [interface]
+
+local dbus = require 'lem.dbus'
+
+local bus = assert(dbus.session())
+
+assert(bus:monitor{ interface = arg[1] })
+
+for msg in bus:messages() do
+	print(('%-13s %s -> %s %s %s.%s'):format(msg:type(),
+		msg:sender() or '-', msg:destination() or '-',
+		msg:path() or '', msg:interface() or '', msg:member() or ''))
+end
+
+-- vim: syntax=lua ts=2 sw=2 noet:
@@ -0,0 +1,85 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-dbus
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-dbus is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-dbus is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+--
+
+-- Export an object from several worker processes behind one
+-- name on the session bus. The front process owns the name and
+-- forwards every call, undecoded, to one of the workers over
+-- a private connection, so the service uses more than one core.
+--
+-- usage: workers.lua [number of workers]
+--
+-- then eg.
+-- dbus-send --session --print-reply --dest=org.lua.Workers \
+--   /org/lua/Workers/3 org.lua.Workers.Whoami
+
+local utils = require 'lem.utils'
+local dbus  = require 'lem.dbus'
+
+local NAME      = 'org.lua.Workers'
+local INTERFACE = 'org.lua.Workers'
+
+if arg[1] == 'worker' then
+	-- connect back to the front process and serve the
+	-- objects there, there is no bus daemon in between
+	local bus = assert(dbus.open(arg[2], true))
+	local pid = arg[3]
+
+	local function serve(path)
+		local obj = dbus.newobject(path)
+		obj:addmethod(INTERFACE, 'Whoami', '', 's', function()
+			return 's', 'worker ' .. pid .. ' serving ' .. path
+		end)
+		assert(bus:registerobject(obj))
+	end
+	for i = 0, 9 do
+		serve('/org/lua/Workers/' .. i)
+	end
+
+	local ok, err = bus:listen()
+	if not ok and err ~= 'interrupted' and err ~= 'closed' then error(err) end
+	return
+end
+
+local n = tonumber(arg[1]) or 4
+
+local bus = assert(dbus.session())
+
+if assert(bus:RequestName(NAME, dbus.NAME_FLAG_DO_NOT_QUEUE))
+		~= dbus.REQUEST_NAME_REPLY_PRIMARY_OWNER then
+	error("couldn't get the name " .. NAME)
+end
+
+local server = assert(dbus.newserver('unix:tmpdir=/tmp'))
+local address = assert(server:address())
+
+-- calls to the same object path always go to the same worker
+local sup = assert(bus:supervise(server, { spread = 'path' }))
+
+for i = 1, n do
+	os.execute(("lem %q worker %q %d &"):format(arg[0], address, i))
+end
+
+print(("forwarding calls to %s to %d workers"):format(NAME, n))
+
+local ok, err = bus:listen()
+if not ok and err ~= 'interrupted' then error(err) end
+
+sup:close()
+
+-- vim: syntax=lua ts=2 sw=2 noet:
@@ -51,6 +51,19 @@ do
 	end
 end
 
+do
+	local require = require
+
+	-- wrap a received file descriptor in a lem.io stream,
+	-- the stream takes over ownership of the descriptor
+	function M.UnixFD:stream()
+		local io = require 'lem.io'
+		local fd, err = self:steal()
+		if not fd then return nil, err end
+		return io.fromfd(fd)
+	end
+end
+
 function M.newerror(name)
 	if name == nil or name == '' then
 		name = 'org.freedesktop.DBus.Error.Failed'
@@ -82,10 +95,366 @@ do
 end
 
 do
-	local call = M.Bus.call
+	local setmetatable, select = setmetatable, select
+	local unpack = unpack or table.unpack
+	local now = require('lem.utils').now
+
+	-- a reply cache with a time to live and a bounded number
+	-- of entries, the least recently used entry is evicted first
+	local Cache = {}
+	Cache.__index = Cache
+	M.Cache = Cache
+
+	function M.newcache(ttl, size)
+		assert(size == nil or size >= 1,
+			'bad argument #2 (size must be at least 1)')
+		local head = {}
+		head.prev, head.next = head, head
+		return setmetatable({
+			ttl = ttl,
+			size = size or 64,
+			n = 0,
+			entries = {},
+			head = head,
+			hits = 0,
+			misses = 0,
+		}, Cache)
+	end
+
+	local function unlink(e)
+		e.prev.next, e.next.prev = e.next, e.prev
+	end
+
+	local function link(head, e)
+		e.prev, e.next = head, head.next
+		head.next.prev = e
+		head.next = e
+	end
+
+	-- returns the entry for key holding the cached values
+	-- from 1 to entry.n, or nil if there is no fresh entry
+	function Cache:lookup(key)
+		local e = self.entries[key]
+		if e then
+			if e.expires > now() then
+				unlink(e)
+				link(self.head, e)
+				self.hits = self.hits + 1
+				return e
+			end
+			unlink(e)
+			self.entries[key] = nil
+			self.n = self.n - 1
+		end
+		self.misses = self.misses + 1
+	end
+
+	function Cache:get(key)
+		local e = self:lookup(key)
+		if e then return unpack(e, 1, e.n) end
+	end
+
+	function Cache:put(key, ...)
+		local entries = self.entries
+		local e = entries[key]
+		if e then
+			unlink(e)
+		else
+			if self.n >= self.size then
+				local last = self.head.prev
+				unlink(last)
+				entries[last.key] = nil
+			else
+				self.n = self.n + 1
+			end
+		end
+		e = { key = key, expires = now() + self.ttl, n = select('#', ...), ... }
+		entries[key] = e
+		link(self.head, e)
+		return ...
+	end
+
+	function Cache:clear()
+		local head = self.head
+		head.prev, head.next = head, head
+		self.entries = {}
+		self.n = 0
+	end
+
+	-- cache successful replies to this method for ttl seconds,
+	-- keeping at most size of them. Only use this for methods
+	-- whose reply depends on nothing but the arguments, and keep
+	-- in mind that every hit returns the very same tables
+	function M.Method:setcache(ttl, size)
+		local cache = M.newcache(ttl, size)
+		self.cache = cache
+		return cache
+	end
+
+	function M.Method:invalidate()
+		local cache = self.cache
+		if cache then cache:clear() end
+	end
+
+	-- clear the cache whenever the given signal is received
+	function M.Method:invalidateon(bus, object, interface, name)
+		local cache = self.cache
+		if not cache then
+			return nil, 'no cache set'
+		end
+
+		return bus:registersignal(object, interface, name, function()
+			cache:clear()
+		end)
+	end
+end
+
+do
+	local setmetatable, assert, type = setmetatable, assert, type
+	local getenv = os.getenv
+	local open = M.open
+	local spawn = require('lem.utils').spawn
+
+	-- a pool of connections to the same bus, which can stand in for
+	-- a Bus when making calls, so proxies may be created on it too.
+	-- Each call goes out on one of the connections, picked by the
+	-- spread option when the pool is created
+	local Pool = {}
+	Pool.__index = Pool
+	M.Pool = Pool
+
+	-- open n private connections to uri, the session bus by default,
+	-- options are
+	--
+	--   spread   'least' (default) to pick the connection with the
+	--            fewest calls waiting for a reply, or 'destination'
+	--            to send all calls to the same destination over the
+	--            same connection, spreading destinations evenly
+	--   ordered  with 'least', calls to a destination which still
+	--            has calls waiting go out on the same connection,
+	--            so they arrive in the order they were made
+	--   peer     the connections go to a peer, don't say Hello
+	--
+	-- returns the pool followed by a list of the unique names
+	function M.newpool(uri, n, options)
+		if not uri then
+			uri = getenv('DBUS_SESSION_BUS_ADDRESS')
+			if not uri then
+				return nil, 'environment variable DBUS_SESSION_BUS_ADDRESS undefined'
+			end
+		end
+		if not n then n = 4 end
+		if not options then options = {} end
+		assert(type(n) == 'number' and n >= 1,
+			'bad argument #2 (expected a positive number)')
+		local spread = options.spread or 'least'
+		assert(spread == 'least' or spread == 'destination',
+			"bad spread (expected 'least' or 'destination')")
+
+		local buses, busy, names = {}, {}, {}
+		for i = 1, n do
+			local bus, err = open(uri)
+			if bus and not options.peer then
+				names[i], err = bus:Hello()
+				if not names[i] then
+					bus:close()
+					bus = nil
+				end
+			end
+			if not bus then
+				for j = 1, i-1 do
+					buses[j]:close()
+				end
+				return nil, err
+			end
+			buses[i], busy[i] = bus, 0
+		end
+
+		return setmetatable({
+			buses = buses,
+			busy = busy,
+			n = n,
+			spread = spread,
+			ordered = options.ordered,
+			destinations = {},
+			last = 0,
+		}, Pool), names
+	end
+
+	local function pick(pool)
+		if pool.spread == 'destination' then
+			local i = pool.last % pool.n + 1
+			pool.last = i
+			return i
+		end
+
+		local busy, best = pool.busy, 1
+		for i = 2, pool.n do
+			if busy[i] < busy[best] then best = i end
+		end
+		return best
+	end
+
+	local function done(pool, d, ...)
+		local i = d.i
+		pool.busy[i] = pool.busy[i] - 1
+		d.n = d.n - 1
+		if d.n == 0 and pool.spread ~= 'destination' then
+			pool.destinations[d.key] = nil
+		end
+		return ...
+	end
+
+	-- Bus.call() raises an error on bad arguments, and as that can't
+	-- be caught across the yield in Lua 5.1 the arguments are checked
+	-- before the call is counted, or the counts would be off for good.
+	-- Values not matching the signature are only found encoding them,
+	-- so the calls go through Bus.trycall() which returns nil and the
+	-- error message for those instead
+	local function check(destination, object, interface, method, signature)
+		assert(destination == nil or type(destination) == 'string',
+			'bad argument #2 (string expected, got '..type(destination))
+		assert(type(object) == 'string',
+			'bad argument #3 (string expected, got '..type(object))
+		assert(type(interface) == 'string',
+			'bad argument #4 (string expected, got '..type(interface))
+		assert(type(method) == 'string',
+			'bad argument #5 (string expected, got '..type(method))
+		assert(signature == nil or type(signature) == 'string',
+			'bad argument #6 (string expected, got '..type(signature))
+	end
+
+	local function poolcall(f)
+		return function(pool, destination, ...)
+			check(destination, ...)
+
+			local key = destination or ''
+			local d
+
+			if pool.ordered or pool.spread == 'destination' then
+				d = pool.destinations[key]
+				if not d then
+					d = { key = key, i = pick(pool), n = 0 }
+					pool.destinations[key] = d
+				end
+			else
+				d = { key = key, i = pick(pool), n = 0 }
+			end
+
+			local i = d.i
+			pool.busy[i] = pool.busy[i] + 1
+			d.n = d.n + 1
+			return done(pool, d, f(pool.buses[i], destination, ...))
+		end
+	end
+
+	Pool.call = poolcall(M.Bus.trycall)
+	Pool.callshared = poolcall(M.Bus.trycallshared)
+
+	-- track the name on every connection, so calls fail on all
+	-- of them when the owner goes away. The connections must
+	-- listen to see NameOwnerChanged, so the first tracked
+	-- name starts a listener on each of them
+	function Pool:trackname(name)
+		if not self.listening then
+			self.listening = true
+			for i = 1, self.n do
+				local bus = self.buses[i]
+				spawn(function() bus:listen() end)
+			end
+		end
+
+		local owner, err
+		for i = 1, self.n do
+			owner, err = self.buses[i]:trackname(name)
+			if owner == nil then return nil, err end
+		end
+		return owner
+	end
+
+	function Pool:nameowner(name)
+		return self.buses[1]:nameowner(name)
+	end
+
+	-- the number of calls waiting for a reply on each connection
+	function Pool:outstanding()
+		local r = {}
+		for i = 1, self.n do
+			r[i] = self.busy[i]
+		end
+		return r
+	end
+
+	function Pool:close()
+		for i = 1, self.n do
+			self.buses[i]:close()
+		end
+		return true
+	end
+end
+
+do
+	local call, callshared = M.Bus.call, M.Bus.callshared
+	local marshal = M.marshal
+	local unpack = unpack or table.unpack
+	local setmetatable, pairs, select = setmetatable, pairs, select
+	local getmetatable = getmetatable
+	local Pool = M.Pool
+
+	-- errors are nil followed by the message, while
+	-- successful replies may carry no values at all
+	local function store(cache, key, ...)
+		if select('#', ...) > 0 and (...) == nil then return ... end
+		return cache:put(key, ...)
+	end
+
+	-- replies from one bus must not answer calls on another,
+	-- so each bus gets a number to put in the cache keys
+	local busids, lastid = setmetatable({}, { __mode = 'k' }), 0
+
+	local function busid(bus)
+		local id = busids[bus]
+		if not id then
+			lastid = lastid + 1
+			id = lastid
+			busids[bus] = id
+		end
+		return id
+	end
+
+	-- set method.coalesce or proxy.coalesce to let identical
+	-- calls made while one is in flight share its reply.
+	-- Pinned proxies send their calls to the unique name
+	-- owning their target, see Proxy:pin()
 	function M.Method.__call(method, proxy, ...)
-		return call(
-			proxy.bus, proxy.target, proxy.object,
+		local f = call
+		if method.coalesce or proxy.coalesce then
+			f = callshared
+		end
+		if getmetatable(proxy.bus) == Pool then
+			f = f == call and Pool.call or Pool.callshared
+		end
+
+		local target = proxy.target
+		if proxy.pinned then
+			target = proxy.bus:nameowner(target) or target
+		end
+
+		local cache, key = method.cache
+		if cache then
+			-- hits are returned right away without yielding
+			key = busid(proxy.bus)..'\n'..(proxy.target or '')..'\n'..
+				proxy.object..'\n'..marshal(method.signature or '', ...)
+			local e = cache:lookup(key)
+			if e then return unpack(e, 1, e.n) end
+			return store(cache, key, f(
+				proxy.bus, target, proxy.object,
+				method.interface, method.name,
+				method.signature, ...))
+		end
+
+		return f(
+			proxy.bus, target, proxy.object,
 			method.interface, method.name,
 			method.signature, ...)
 	end
@@ -98,16 +467,48 @@ do
 			'Hello')
 	end
 
+	-- the names requested on each bus, and their flags,
+	-- so they can be requested again after a reconnect
+	local owned = setmetatable({}, { __mode = 'k' })
+
+	local function requested(bus, name, flags, r, ...)
+		-- primary owner, in queue or already owner
+		if r == 1 or r == 2 or r == 4 then
+			local names = owned[bus]
+			if not names then
+				names = {}
+				owned[bus] = names
+			end
+			names[name] = flags
+		end
+		return r, ...
+	end
+
 	function M.Bus:RequestName(name, flags)
-		return call(self, target, object, interface,
-			'RequestName', 'su', name, flags or 0)
+		flags = flags or 0
+		return requested(self, name, flags, call(self, target, object,
+			interface, 'RequestName', 'su', name, flags))
 	end
 
 	function M.Bus:ReleaseName(name)
+		local names = owned[self]
+		if names then names[name] = nil end
 		return call(self, target, object, interface,
 			'ReleaseName', 's', name)
 	end
 
+	-- returns a table of the names requested on the
+	-- bus and not released, and the flags used
+	function M.Bus:ownednames()
+		local names, r = owned[self], {}
+		if names then
+			for name, flags in pairs(names) do
+				r[name] = flags
+			end
+		end
+		return r
+	end
+
 	function M.Bus:AddMatch(rule)
 		return call(self, target, object, interface,
 			'AddMatch', 's', rule)
@@ -119,6 +520,163 @@ do
 	end
 end
 
+do
+	local call = M.Bus.call
+
+	-- turn the connection into a monitor receiving copies of the
+	-- messages passing through the bus, options are
+	--
+	--   rules      list of match rules, everything by default
+	--   types      list of message types to keep, eg. { 'signal' }
+	--   sender     keep only messages from this unique name
+	--   interface  keep only messages with this interface
+	--   queue      how many messages may wait for Bus:nextmessage(),
+	--              the rest are dropped and counted in Bus:stats()
+	--
+	-- the filtering happens in C before any Lua code runs, and the
+	-- Message objects returned decode their arguments only when
+	-- asked to with Message:args()
+	function M.Bus:monitor(options)
+		if not options then options = {} end
+
+		local ok, err = self:setmonitor(options.types,
+			options.sender, options.interface, options.queue)
+		if not ok then return nil, err end
+
+		local _, err = call(self, M.SERVICE_DBUS, M.PATH_DBUS,
+			'org.freedesktop.DBus.Monitoring', 'BecomeMonitor',
+			'asu', options.rules or {}, 0)
+		if err then
+			self:stopmonitor()
+			return nil, err
+		end
+
+		return true
+	end
+
+	-- iterate over the monitored messages, eg.
+	-- for msg in bus:messages() do ... end
+	function M.Bus:messages()
+		return function()
+			return self:nextmessage()
+		end
+	end
+end
+
+do
+	local require, tonumber, assert = require, tonumber, assert
+	local byte = string.byte
+	local opencapture = M.opencapture
+
+	-- message types in the second byte of a message
+	local METHOD_CALL, SIGNAL = 1, 4
+
+	-- re-send the method calls and signals of a capture file
+	-- written by Bus:capture(), options are
+	--
+	--   rate         'original' (default), 'max' or a speed
+	--                factor, eg. 2 replays twice as fast
+	--   direction    'in' (default) or 'out', replay the messages
+	--                received or the ones sent while capturing
+	--   destination  send everything here instead
+	--
+	-- replies are not waited for, so the load stays the same
+	-- even if the server is slower than the one captured
+	function M.Bus:replay(filename, options)
+		local utils = require 'lem.utils'
+		local now = utils.now
+
+		if not options then options = {} end
+		local rate = options.rate or 'original'
+		local direction = options.direction or 'in'
+		local destination = options.destination
+
+		local speed
+		if rate == 'original' then
+			speed = 1
+		elseif rate ~= 'max' then
+			speed = tonumber(rate)
+			assert(speed and speed > 0, 'bad rate')
+		end
+
+		local capture, err = opencapture(filename)
+		if not capture then return nil, err end
+
+		local sleeper = utils.newsleeper()
+		local sent, first, start = 0, nil, nil
+		while true do
+			local t, dir, bytes = capture:read()
+			if not t then
+				err = dir
+				break
+			end
+
+			local kind = byte(bytes, 2)
+			if dir == direction and (kind == METHOD_CALL or kind == SIGNAL) then
+				if speed then
+					if not first then first, start = t, now() end
+					local delay = start + (t - first) / speed - now()
+					if delay > 0 then sleeper:sleep(delay) end
+				elseif sent % 64 == 63 then
+					-- let the event loop write out what we have
+					utils.yield()
+				end
+
+				local ok, serr = self:sendraw(bytes, destination)
+				if not ok then
+					err = serr
+					break
+				end
+				sent = sent + 1
+			end
+		end
+
+		capture:close()
+		if err then return nil, err end
+
+		-- don't return before the event loop has written it all
+		while true do
+			local st = self:stats()
+			if st.outgoing == 0 and st.queued == 0 then break end
+			sleeper:sleep(0.001)
+		end
+		return sent
+	end
+end
+
+do
+	local call, getmetatable = M.Bus.call, getmetatable
+	local newblob, UnixFD = M.newblob, M.UnixFD
+
+	-- call a method taking a single blob argument,
+	-- a blob returned by the method is mapped before
+	-- being handed back to the caller
+	function M.Bus:callblob(destination, path, interface, method, data)
+		local fd, err = newblob(data)
+		if not fd then return nil, err end
+
+		local r, err = call(self, destination, path, interface, method,
+			'h', fd)
+		fd:close()
+		if getmetatable(r) == UnixFD then
+			local blob, err = r:map()
+			r:close()
+			return blob, err
+		end
+		return r, err
+	end
+
+	-- use as 'return dbus.blobreply(data)' in methods
+	-- added with Object:addmethod()
+	function M.blobreply(data)
+		local fd, err = newblob(data)
+		if not fd then
+			return nil, 'org.freedesktop.DBus.Error.NoMemory', err
+		end
+		return 'h', fd
+	end
+end
+
 do
 	local setmetatable = setmetatable
 	local Proxy = M.Proxy
@@ -131,6 +689,7 @@ do
 		}, Proxy)
 	end
 	M.Bus.newproxy = newproxy
+	M.Pool.newproxy = newproxy
 
 	local Introspect = M.newmethod(M.INTERFACE_INTROSPECTABLE, 'Introspect')
 	M.Introspect = Introspect
@@ -146,19 +705,209 @@ do
 
 		return proxy
 	end
+	M.Pool.autoproxy = M.Bus.autoproxy
 end
 
 do
-	local assert, getmetatable, type = assert, getmetatable, type
+	local assert, getmetatable, setmetatable, type, pairs =
+		assert, getmetatable, setmetatable, type, pairs
 	local format = string.format
 	local Bus = M.Bus
 
-	function Bus:registersignal(object, interface, name, f)
+	-- several handlers of the same signal are kept in a list the
+	-- C code calls like a function. The arguments are decoded once
+	-- and every handler is called in turn on the same coroutine, so
+	-- handlers must not modify tables they're given and should spawn
+	-- a new coroutine for anything that may take a while. Lists are
+	-- never changed once stored, a new one replaces it instead, so
+	-- handlers may come and go while the list is being called.
+	local Subscribers = {}
+	M.Subscribers = Subscribers
+
+	function Subscribers.__call(list, ...)
+		for i = 1, #list do
+			list[i](...)
+		end
+	end
+
+	local Match, Latest = M.Match, M.Latest
+
+	local function handler(entry)
+		if getmetatable(entry) == Match then
+			return entry:handler()
+		end
+		return entry
+	end
+
+	local function samerules(a, b)
+		if a == nil or b == nil then return a == b end
+		for k, v in pairs(a) do
+			if b[k] ~= v then return false end
+		end
+		for k in pairs(b) do
+			if a[k] == nil then return false end
+		end
+		return true
+	end
+
+	-- true if f is already a handler with the very same rules
+	local function subscribed(old, f, rules)
+		if old == nil then return false end
+		if getmetatable(old) ~= Subscribers then old = { old } end
+		for i = 1, #old do
+			local h, r = handler(old[i])
+			if h == f and samerules(r, rules) then return true end
+		end
+		return false
+	end
+
+	local function subscribe(old, entry)
+		if old == nil then return entry end
+		if getmetatable(old) ~= Subscribers then
+			return setmetatable({ old, entry }, Subscribers)
+		end
+
+		local n = #old
+		local new = {}
+		for i = 1, n do
+			new[i] = old[i]
+		end
+		new[n+1] = entry
+		return setmetatable(new, Subscribers)
+	end
+
+	-- returns the handlers left after removing f, or all of
+	-- them if f is nil, followed by a list of those removed
+	local function unsubscribe(old, f)
+		if getmetatable(old) ~= Subscribers then
+			if f == nil or handler(old) == f then
+				return nil, { old }
+			end
+			return old, {}
+		end
+
+		local new, n, removed = {}, 0, {}
+		for i = 1, #old do
+			local entry = old[i]
+			if f == nil or handler(entry) == f then
+				removed[#removed+1] = entry
+			else
+				n = n+1
+				new[n] = entry
+			end
+		end
+		if n == 0 then return nil, removed end
+		if n == 1 then return new[1], removed end
+		return setmetatable(new, Subscribers), removed
+	end
+
+	-- this magic string representation of an incoming
+	-- signal must match the one in the C code
+	local function signalkey(object, interface, name)
+		return format('%s\n%s\n%s', object, interface, name)
+	end
+
+	local sort, concat = table.sort, table.concat
+	local match = string.match
+
+	-- the sender and argN rules of a handler are
+	-- also sent to the bus daemon with its match rule
+	local function matchrule(object, interface, name, rules)
+		local rule = format("type='signal',path='%s',interface='%s',member='%s'",
+			object, interface, name)
+		if rules == nil then return rule end
+
+		local keys, n = {}, 0
+		for k in pairs(rules) do
+			n = n+1
+			keys[n] = k
+		end
+		sort(keys)
+
+		local t = { rule }
+		for i = 1, n do
+			local k = keys[i]
+			t[i+1] = format("%s='%s'", k, (rules[k]:gsub("'", "'\\''")))
+		end
+		return concat(t, ',')
+	end
+
+	local newmatch = M.newmatch
+
+	-- rules may also be given in the table describing a signal
+	local function tablerules(t)
+		local rules
+		for k, v in pairs(t) do
+			if k == 'sender' or match(k, '^arg%d') then
+				if not rules then rules = {} end
+				rules[k] = v
+			end
+		end
+		return rules
+	end
+
+	-- the owners of the names tracked on each bus, and the Match
+	-- objects with a well-known name as sender, see Bus:trackname()
+	local tracked = setmetatable({}, { __mode = 'k' })
+	local weak = { __mode = 'k' }
+	local weakvalue = { __mode = 'v' }
+
+	-- Lua 5.1 has no ephemerons, so nothing reachable from
+	-- tracked[bus] may refer to the bus, or it is never collected.
+	-- The handlers find the bus through the weak t.bus instead
+	local function tracker(bus)
+		local t = tracked[bus]
+		if not t then
+			t = { owners = {}, handlers = {}, matches = {},
+				bus = setmetatable({ bus }, weakvalue) }
+			tracked[bus] = t
+		end
+		return t
+	end
+
+	local function setowner(t, name, owner)
+		t.owners[name] = owner
+		local set = t.matches[name]
+		if set then
+			for m in pairs(set) do
+				m:setowner(owner)
+			end
+		end
+	end
+
+	local function watchsender(bus, m, sender)
+		if sender == nil or match(sender, '^:') then return end
+		local t = tracker(bus)
+		local set = t.matches[sender]
+		if not set then
+			set = setmetatable({}, weak)
+			t.matches[sender] = set
+		end
+		set[m] = true
+		m:setowner(t.owners[sender])
+	end
+
+	local function unwatchsender(bus, m, sender)
+		local t = tracked[bus]
+		if t == nil or sender == nil then return end
+		local set = t.matches[sender]
+		if set then set[m] = nil end
+	end
+
+	-- call f whenever the signal is received, in addition to any
+	-- other handlers already registered for it. The optional rules
+	-- table restricts this to signals from a given sender, or with
+	-- certain arguments, using keys like 'sender', 'arg0', 'arg2path'
+	-- and 'arg0namespace' which mean the same as in a match rule.
+	-- They are checked before any arguments are decoded, and are
+	-- added to the match rule so the bus daemon checks them too.
+	function Bus:registersignal(object, interface, name, f, rules)
 		assert(getmetatable(self) == Bus,
 			'bad argument #1 (expected a DBus connection)')
 		if type(object) == 'table' then
 			local t = object
 			f = interface
+			rules = name or tablerules(t)
 			object = t.object
 			interface = t.interface
 			name = t.name
@@ -169,39 +918,42 @@ do
 			'bad argument #3 (string expected, got '..type(interface))
 		assert(type(name) == 'string',
 			'bad argument #4 (string expected, got '..type(name))
-		assert(type(f) == 'function',
+		assert(type(f) == 'function' or getmetatable(f) == Latest,
 			'bad argument #5 (function expected, got '..type(f))
+		assert(rules == nil or type(rules) == 'table',
+			'bad argument #6 (table expected, got '..type(rules))
 
 		local t, err = self:signaltable()
 		if not t then return nil, err end
 
-		-- this magic string representation of an incoming
-		-- signal must match the one in the C code
-		local s = format('%s\n%s\n%s', object, interface, name)
+		local s = signalkey(object, interface, name)
+		if subscribed(t[s], f, rules) then return true end
+
+		-- check the rules before the bus daemon gets them
+		local entry = f
+		if rules then entry = newmatch(rules, f) end
 
-		if t[s] == nil then
-			local r, err = self:AddMatch(
-				format("type='signal',path='%s',interface='%s',member='%s'",
-					object, interface, name))
+		-- peers send their signals to us directly,
+		-- there is no bus daemon to add match rules to
+		if not self:ispeer() then
+			local r, err = self:AddMatch(matchrule(object, interface, name, rules))
 			if err then return nil, err end
 		end
 
-		t[s] = f
+		if rules then watchsender(self, entry, rules.sender) end
+		t[s] = subscribe(t[s], entry)
 
 		return true
 	end
-end
 
-do
-	local assert, getmetatable, type = assert, getmetatable, type
-	local format = string.format
-	local Bus = M.Bus
-
-	function Bus:unregistersignal(object, interface, name)
+	-- stop calling f when the signal is received,
+	-- or any handler of it if f is not given
+	function Bus:unregistersignal(object, interface, name, f)
 		assert(getmetatable(self) == Bus,
 			'bad argument #1 (expected a DBus connection)')
 		if type(object) == 'table' then
 			local t = object
+			f = interface
 			object = t.object
 			interface = t.interface
 			name = t.name
@@ -216,25 +968,275 @@ do
 		local t, err = self:signaltable()
 		if not t then return nil, err end
 
-		-- this magic string representation of an incoming
-		-- signal must match the one in the C code
-		local s = format('%s\n%s\n%s', object, interface, name)
+		local s = signalkey(object, interface, name)
 
 		assert(t[s] ~= nil, 'signal not set')
 
-		local r, err = self:RemoveMatch(
-			format("type='signal',path='%s',interface='%s',member='%s'",
-				object, interface, name))
-		if err then return nil, err end
+		local handlers, removed = unsubscribe(t[s], f)
+		t[s] = handlers
+
+		-- the handlers are gone already, so clean up after every
+		-- one of them and only then report the first error
+		local peer, failed = self:ispeer(), nil
+		for i = 1, #removed do
+			local h, rules = handler(removed[i])
+			if getmetatable(h) == Latest then h:close() end
+			if rules then unwatchsender(self, removed[i], rules.sender) end
+			if not peer then
+				local r, err = self:RemoveMatch(matchrule(object, interface, name, rules))
+				if err and not failed then failed = err end
+			end
+		end
+
+		if failed then return nil, failed end
+		return true
+	end
+
+	local call = Bus.call
+	local SERVICE_DBUS, PATH_DBUS, INTERFACE_DBUS =
+		M.SERVICE_DBUS, M.PATH_DBUS, M.INTERFACE_DBUS
+
+	-- keep track of who owns the well-known name using the
+	-- NameOwnerChanged signal. Returns the unique name of the
+	-- current owner, or false if the name has no owner.
+	-- While a name is tracked
+	--
+	--   Bus:nameowner() returns its owner without asking the bus
+	--   pinned proxies send their calls straight to the owner
+	--   handlers registered with the name as sender rule drop
+	--     signals from anyone else before decoding them
+	--   calls to the name or its owner fail as soon as the owner
+	--     goes away, rather than when they time out
+	function Bus:trackname(name)
+		assert(getmetatable(self) == Bus,
+			'bad argument #1 (expected a DBus connection)')
+		assert(type(name) == 'string',
+			'bad argument #2 (string expected, got '..type(name))
+
+		local t = tracker(self)
+		if t.handlers[name] then return t.owners[name] end
+
+		local function changed(_, old, new)
+			if new == '' then new = false end
+			setowner(t, name, new)
+			local bus = t.bus[1]
+			if bus and not new and old ~= '' then
+				bus:failcalls(name)
+				bus:failcalls(old)
+			end
+		end
+
+		-- subscribe before asking, so no change is missed
+		t.handlers[name] = changed
+		local ok, err = self:registersignal(PATH_DBUS, INTERFACE_DBUS,
+			'NameOwnerChanged', changed,
+			{ sender = SERVICE_DBUS, arg0 = name })
+		if not ok then
+			t.handlers[name] = nil
+			return nil, err
+		end
+
+		-- GetNameOwner fails when the name has no owner
+		local owner = call(self, SERVICE_DBUS, PATH_DBUS, INTERFACE_DBUS,
+			'GetNameOwner', 's', name)
+
+		-- a signal received meanwhile is more recent
+		if t.handlers[name] == changed and t.owners[name] == nil then
+			setowner(t, name, owner or false)
+		end
+		return t.owners[name]
+	end
+
+	function Bus:untrackname(name)
+		local t = tracked[self]
+		local changed = t and t.handlers[name]
+		if not changed then return nil, 'name not tracked' end
+
+		t.handlers[name] = nil
+		setowner(t, name, nil)
+		return self:unregistersignal(PATH_DBUS, INTERFACE_DBUS,
+			'NameOwnerChanged', changed)
+	end
+
+	-- the unique name owning a tracked name, false if it has no
+	-- owner and nil if the name isn't tracked
+	function Bus:nameowner(name)
+		local t = tracked[self]
+		if t then return t.owners[name] end
+	end
+
+	-- send the calls of this proxy to the unique name owning its
+	-- target, so the bus daemon doesn't resolve the name on every
+	-- call and calls fail right away when the owner goes away
+	function M.Proxy:pin()
+		local owner, err = self.bus:trackname(self.target)
+		if owner == nil then return nil, err end
+		self.pinned = true
+		return owner
+	end
+
+	local newlatest = M.newlatest
+	local spawn = require('lem.utils').spawn
+
+	-- wrap f in a handler for Bus:registersignal() which never falls
+	-- behind: signals wait undecoded until f is done with the previous
+	-- one, and a newer signal replaces the one waiting. With a key
+	-- the signals are coalesced by the value of that argument instead,
+	-- counting from 0 like argN rules, keeping up to size keys.
+	-- f is called as f(dropped, ...) where dropped is the number of
+	-- signals replaced by this one. Latest:stats() counts them all.
+	function M.latest(f, key, size)
+		assert(type(f) == 'function',
+			'bad argument #1 (function expected, got '..type(f))
+		local l = newlatest(key, size)
+
+		local function handle(dropped, ...)
+			if dropped == nil then return false end
+			f(dropped, ...)
+			return true
+		end
+
+		spawn(function()
+			while handle(l:next()) do end
+		end)
+
+		return l
+	end
+
+	local utils = require 'lem.utils'
+	local now, newsleeper = utils.now, utils.newsleeper
+	local unpack = unpack or table.unpack
+
+	-- make the calls in the list all at once, and wait
+	-- for every reply. Returns a list of the results
+	local function burst(bus, calls)
+		local n = #calls
+		local results, left = {}, n
+		local sleeper = newsleeper()
+
+		for i = 1, n do
+			spawn(function()
+				local c = calls[i]
+				results[i] = { call(bus, unpack(c, 1, c.n)) }
+				left = left - 1
+				if left == 0 then sleeper:wakeup() end
+			end)
+		end
+
+		if left > 0 then sleeper:sleep() end
+		return results
+	end
+
+	local function daemoncall(method, signature, ...)
+		return { n = 5 + select('#', ...), SERVICE_DBUS, PATH_DBUS,
+			INTERFACE_DBUS, method, signature, ... }
+	end
+
+	-- reopen the bus, which says Hello before anything else goes
+	-- out, and ask for everything the old connection owned in one
+	-- go. Returns the new unique name and a list of the errors of
+	-- the calls that failed
+	local function restore(bus, uri)
+		local unique, err = bus:reopen(uri)
+		if not unique then return nil, err end
+		-- peers have no bus daemon to ask
+		if unique == true then return true, {} end
+
+		local calls, tracking = {}, {}
+
+		for name, flags in pairs(bus:ownednames()) do
+			calls[#calls+1] = daemoncall('RequestName', 'su', name, flags)
+		end
+
+		local t = bus:signaltable()
+		for s, old in pairs(t) do
+			local object, interface, name = match(s, '^(.-)\n(.-)\n(.*)$')
+			local list = old
+			if getmetatable(old) ~= Subscribers then list = { old } end
+			for i = 1, #list do
+				local _, rules = handler(list[i])
+				calls[#calls+1] = daemoncall('AddMatch', 's',
+					matchrule(object, interface, name, rules))
+			end
+		end
+
+		-- owners may have come and gone meanwhile
+		local tr = tracked[bus]
+		if tr then
+			for name in pairs(tr.handlers) do
+				tracking[#calls+1] = name
+				calls[#calls+1] = daemoncall('GetNameOwner', 's', name)
+			end
+		end
+
+		local results = burst(bus, calls)
+		local errors = {}
+		for i = 1, #results do
+			local name = tracking[i]
+			local r = results[i]
+			if name then
+				setowner(tr, name, r[1] or false)
+			elseif r[1] == nil then
+				errors[#errors+1] = r[2]
+			end
+		end
+		return unique, errors
+	end
 
-		t[s] = nil
+	-- keep the bus connected to uri. When the connection is lost
+	-- a new one is opened, trying again with exponential backoff,
+	-- and once it has said Hello the requested names and match
+	-- rules are asked for again in one pipelined burst. Handlers, exported
+	-- objects and listening carry over as they are. Options are
+	--
+	--   backoff     first delay between attempts, 0.05s by default
+	--   maxbackoff  longest delay between attempts, 5s by default
+	--   onreconnect called as onreconnect(bus, gap, name, errors)
+	--               once restored, where gap is the number of
+	--               seconds the bus was gone, name the new unique
+	--               name and errors a list of calls which failed
+	--
+	-- Calls waiting for a reply when the connection is lost fail,
+	-- as do calls made before it is restored.
+	function Bus:autoreconnect(uri, options)
+		assert(getmetatable(self) == Bus,
+			'bad argument #1 (expected a DBus connection)')
+		assert(type(uri) == 'string',
+			'bad argument #2 (string expected, got '..type(uri))
+		if not options then options = {} end
+		local backoff = options.backoff or 0.05
+		local maxbackoff = options.maxbackoff or 5
+		local onreconnect = options.onreconnect
+
+		spawn(function()
+			local sleeper = newsleeper()
+
+			while self:waitdisconnect() do
+				local lost, delay = now(), backoff
+				local name, errors
+
+				while true do
+					name, errors = restore(self, uri)
+					if name then break end
+					-- the bus was closed meanwhile
+					if errors == 'closed' then return end
+					sleeper:sleep(delay)
+					delay = delay * 2
+					if delay > maxbackoff then delay = maxbackoff end
+				end
+
+				if onreconnect then
+					onreconnect(self, now() - lost, name, errors)
+				end
+			end
+		end)
 
 		return true
 	end
 end
 
 do
-	local assert, getmetatable = assert, getmetatable
+	local assert, getmetatable, type = assert, getmetatable, type
 	local pairs, concat = pairs, table.concat
 
 	local Object = {}
@@ -252,9 +1254,10 @@ do
 		end
 
 		n = 0
-		for path, _ in pairs(objects) do
+		for path, methods in pairs(objects) do
 			path = path:match('/*(.*)')
-			if path ~= '' then
+			-- raw handlers don't take part in introspection
+			if path ~= '' and type(methods) == 'table' then
 				n = n+1
 				write('<node name="', path, '" />')
 			end
@@ -300,6 +1303,178 @@ do
 		return true
 	end
 
+	-- handle every method call to path with f(msg), where msg is
+	-- a Message object which isn't decoded unless asked to, and
+	-- can be passed on as is with Bus:forward(). Without a path
+	-- f gets the calls to all paths with no object registered.
+	function M.Bus:registerraw(path, f)
+		assert(type(f) == 'function', 'bad argument #3 (expected a function)')
+		local objects, err = self:objecttable()
+		if not objects then return nil, err end
+		objects[path or '*'] = f
+		return true
+	end
+
+	function M.Bus:unregisterraw(path)
+		local objects, err = self:objecttable()
+		if not objects then return nil, err end
+		objects[path or '*'] = nil
+		return true
+	end
+
+	local setmetatable, remove = setmetatable, table.remove
+	local byte, floor = string.byte, math.floor
+	local spawn = require('lem.utils').spawn
+
+	local Supervisor = {}
+	Supervisor.__index = Supervisor
+	M.Supervisor = Supervisor
+
+	-- the worker for an object path, the one with the highest
+	-- score for the path's hash wins, so when a worker comes or
+	-- goes only the paths it wins move. The hashes are cached
+	-- as the same paths are called over and over
+	local function pathworker(sup, path)
+		local hashes = sup.hashes
+		local h = hashes[path]
+		if not h then
+			h = 0
+			for i = 1, #path do
+				h = (h * 31 + byte(path, i)) % 2147483647
+			end
+			if sup.nhashes >= 4096 then
+				hashes = {}
+				sup.hashes, sup.nhashes = hashes, 0
+			end
+			hashes[path] = h
+			sup.nhashes = sup.nhashes + 1
+		end
+		local workers, ids = sup.workers, sup.ids
+		local best, max = nil, -1
+		for i = 1, #workers do
+			local w = workers[i]
+			local x = (h + ids[w] * 40503) % 2147483647
+			x = x * 48271 % 2147483647
+			local lo, hi = x % 65536, floor(x / 65536)
+			x = (lo * hi + lo * 40503 + hi) % 2147483647 * 48271 % 2147483647
+			if x > max then best, max = w, x end
+		end
+		return best
+	end
+
+	local function leastworker(sup)
+		local workers = sup.workers
+		local best, min = workers[1], workers[1]:pending()
+		for i = 2, #workers do
+			local n = workers[i]:pending()
+			if n < min then best, min = workers[i], n end
+		end
+		return best
+	end
+
+	local function removeworker(sup, w)
+		local workers = sup.workers
+		sup.ids[w] = nil
+		for i = 1, #workers do
+			if workers[i] == w then
+				remove(workers, i)
+				break
+			end
+		end
+	end
+
+	-- spread the method calls made to this bus over worker processes
+	-- connected to server, a Server from newserver(). Every call to
+	-- path, or to any path with no object registered if path is nil,
+	-- is forwarded undecoded to a worker, and its reply is sent back
+	-- to the caller the same way. Workers connect with
+	-- open(address, true), where address is server:address(), and
+	-- register their objects on that connection. Options are
+	--
+	--   spread  'path' (default) to send the calls to an object
+	--           path to the same worker for as long as it stays
+	--           connected, or 'least' for the worker with the
+	--           fewest calls waiting for a reply
+	--   path    only forward calls to this object path
+	--
+	-- This process keeps the well-known name and anything registered
+	-- on the bus itself. Workers disconnecting are dropped, calls still
+	-- waiting for their reply fail with NoReply, and calls made while
+	-- there are no workers fail.
+	function M.Bus:supervise(server, options)
+		assert(getmetatable(server) == M.Server,
+			'bad argument #2 (expected a Server)')
+		if not options then options = {} end
+		local spread = options.spread or 'path'
+		assert(spread == 'path' or spread == 'least',
+			"bad spread (expected 'path' or 'least')")
+
+		local sup = setmetatable({
+			bus = self,
+			server = server,
+			path = options.path,
+			workers = {},
+			ids = {},
+			nextid = 0,
+			hashes = {},
+			nhashes = 0,
+		}, Supervisor)
+
+		local pick = leastworker
+		if spread == 'path' then pick = pathworker end
+
+		local ok, err = self:registerraw(options.path, function(msg)
+			if #sup.workers == 0 then
+				return msg:error('org.freedesktop.DBus.Error.NoServer',
+					'no workers')
+			end
+			local w = pick(sup, msg:path())
+			local ok, err = w:forward(msg)
+			if not ok then
+				msg:error('org.freedesktop.DBus.Error.Failed', err)
+			end
+		end)
+		if not ok then return nil, err end
+
+		spawn(function()
+			while true do
+				local w = server:accept()
+				if not w then break end
+				local workers = sup.workers
+				workers[#workers+1] = w
+				sup.nextid = sup.nextid + 1
+				sup.ids[w] = sup.nextid
+				spawn(function()
+					w:waitdisconnect()
+					removeworker(sup, w)
+					-- closing answers the calls forwarded
+					-- to w with NoReply
+					w:close()
+				end)
+			end
+		end)
+
+		return sup
+	end
+
+	-- the number of workers connected
+	function Supervisor:workers()
+		return #self.workers
+	end
+
+	-- stop forwarding calls and accepting workers,
+	-- those connected are disconnected
+	function Supervisor:close()
+		self.bus:unregisterraw(self.path)
+		self.server:close()
+		local workers = self.workers
+		self.workers, self.ids = {}, {}
+		for i = 1, #workers do
+			workers[i]:close()
+		end
+		return true
+	end
+
 	local sub, concat = string.sub, table.concat
 
 	local function value_end(i, sig)
@@ -364,6 +1539,48 @@ do
 		end
 	end
 
+	local newreply = M.newreply
+
+	-- add a method which always returns the same values,
+	-- the reply is encoded once here and only copied on every call
+	function Object:addstatic(interface, name, in_sig, out_sig, ...)
+		local encoded = assert(newreply(out_sig or '', ...))
+
+		self:addmethod(interface, name, in_sig, out_sig)
+		self.lookup[interface..'.'..name] = function(reply) reply(false, encoded) end
+	end
+
+	local newlimit = M.newlimit
+
+	-- handle at most max calls to this object at once, letting up to
+	-- queue more wait for a slot. Calls beyond that are answered with
+	-- org.freedesktop.DBus.Error.LimitsExceeded right away.
+	-- Waiting calls are served one sender at a time in turn, and no
+	-- more than persender (default queue) of them may be from the
+	-- same sender, so one busy client can't crowd out the others.
+	-- Returns the limit, whose stats() method reports how many calls
+	-- are being handled, waiting and have been shed. The limit is
+	-- removed again when max is nil.
+	function Object:setlimit(max, queue, persender)
+		local limit = max and newlimit(max, queue, persender) or nil
+		self.lookup[1] = limit
+		return limit
+	end
+
+	-- like Object:setlimit(), but only for calls to one method,
+	-- calls past this limit still count against the object limit
+	function Object:setmethodlimit(interface, name, max, queue, persender)
+		local lookup = self.lookup
+		local limits = lookup[2]
+		if not limits then
+			limits = {}
+			lookup[2] = limits
+		end
+		local limit = max and newlimit(max, queue, persender) or nil
+		limits[interface..'.'..name] = limit
+		return limit
+	end
+
 	local pairs = pairs
 
 	local function generate_xml(interfaces)
@@ -417,6 +1634,104 @@ do
 	end
 end
 
+do
+	local setmetatable = setmetatable
+	local call, newring, openring = M.Bus.call, M.newring, M.openring
+	local newobject = M.newobject
+
+	-- Channels carry a one-way stream of messages from a client to an
+	-- exported channel object. When file descriptors can be passed the
+	-- messages go through a shared memory ring, otherwise every message
+	-- is an ordinary method call on the channel object.
+	local CHANNEL = 'org.lem.dbus.Channel'
+
+	local Channel = {}
+	Channel.__index = Channel
+	M.Channel = Channel
+
+	function M.newchannel(path, handler)
+		local obj = newobject(path)
+		local lookup = obj.lookup
+
+		obj:addmethod(CHANNEL, 'Open', 'hh', 'b')
+		lookup[CHANNEL..'.Open'] = function(reply, memfd, eventfd)
+			local ring, err = openring(memfd, eventfd)
+			memfd:close()
+			eventfd:close()
+			if not ring then
+				return reply(nil, 'org.freedesktop.DBus.Error.Failed', err)
+			end
+			reply('b', true)
+
+			local function dispatch(signature, ...)
+				if signature == nil then return false end
+				handler(...)
+				return true
+			end
+			while dispatch(ring:receive()) do end
+			ring:close()
+		end
+
+		-- fallback for peers that can't pass file descriptors
+		obj:addmethod(CHANNEL, 'Push', '', '')
+		lookup[CHANNEL..'.Push'] = function(reply, ...)
+			reply()
+			handler(...)
+		end
+
+		return obj
+	end
+
+	function M.Bus:openchannel(target, object, size)
+		local ch = setmetatable({
+			bus = self,
+			target = target,
+			object = object
+		}, Channel)
+
+		if self:cansendfd() then
+			local ring = newring(size)
+			local memfd, eventfd = ring and ring:fds()
+			if memfd then
+				local ok = call(self, target, object, CHANNEL, 'Open',
+					'hh', memfd, eventfd)
+				memfd:close()
+				eventfd:close()
+				if ok then
+					ch.ring = ring
+				else
+					ring:close()
+				end
+			end
+		end
+
+		return ch
+	end
+
+	-- returns nil, 'full' if the ring is full,
+	-- the caller decides whether to drop or retry
+	function Channel:send(signature, ...)
+		local ring = self.ring
+		if ring then
+			return ring:send(signature, ...)
+		end
+
+		local _, err = call(self.bus, self.target, self.object,
+			CHANNEL, 'Push', signature, ...)
+		if err then return nil, err end
+		return true
+	end
+
+	function Channel:close()
+		local ring = self.ring
+		if ring then
+			self.ring = nil
+			return ring:close()
+		end
+		return true
+	end
+end
+
 return M
 
 -- vim: syntax=lua ts=2 sw=2 noet:
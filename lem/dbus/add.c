@@ -20,6 +20,8 @@
 #include <lem.h>
 #include <dbus/dbus.h>
 
+#include "fd.h"
+
 #define EXPORT
 #endif
 
@@ -177,6 +179,25 @@ add_object_path(lua_State *L, int index,
 	return ADD_OK;
 }
 
+static enum add_return
+add_unix_fd(lua_State *L, int index,
+            DBusSignatureIter *type, DBusMessageIter *args)
+{
+	int fd;
+
+	(void)type;
+
+	/* libdbus dup()s the descriptor, so the caller keeps its own */
+	fd = lem_dbus_fd_get(L, index);
+	if (fd < 0)
+		return add_error(L, index, LUA_TNUMBER);
+	if (!dbus_message_iter_append_basic(args, DBUS_TYPE_UNIX_FD, &fd)) {
+		lua_pushliteral(L, "(error duplicating file descriptor)");
+		return ADD_ERROR;
+	}
+	return ADD_OK;
+}
+
 static enum add_return
 add_array(lua_State *L, int index,
           DBusSignatureIter *type, DBusMessageIter *args)
@@ -243,6 +264,8 @@ get_addfunc(DBusSignatureIter *type)
 		return add_string;
 	case DBUS_TYPE_OBJECT_PATH:
 		return add_object_path;
+	case DBUS_TYPE_UNIX_FD:
+		return add_unix_fd;
 	case DBUS_TYPE_ARRAY:
 		return add_array;
 	}
@@ -0,0 +1,330 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AMALG
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lem.h>
+
+#include "fd.h"
+
+#define EXPORT
+#endif
+
+#define LEM_DBUS_BLOB_META "lem.dbus.Blob"
+
+/*
+ * Blobs are large payloads passed as sealed memfds. The sender
+ * writes the data once into an anonymous file and seals it, and the
+ * receiver maps it read-only, so neither libdbus nor the daemon ever
+ * touch the payload itself.
+ */
+struct blob {
+	const char *data;
+	size_t len;
+};
+
+#if defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define BLOB_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+#endif
+
+static int
+blob_closed(lua_State *T)
+{
+	lua_pushnil(T);
+	lua_pushliteral(T, "closed");
+	return 2;
+}
+
+static int
+blob_error(lua_State *T, int fd, const char *msg)
+{
+	int err = errno;
+
+	if (fd >= 0)
+		(void)close(fd);
+
+	lua_pushnil(T);
+	lua_pushfstring(T, "%s: %s", msg, strerror(err));
+	return 2;
+}
+
+/*
+ * newblob()
+ *
+ * argument 1: data
+ * argument 2: name (optional)
+ *
+ * Returns a UnixFD object for a sealed memfd holding data.
+ */
+EXPORT int
+lem_dbus_blob_new(lua_State *T)
+{
+#ifdef BLOB_SEALS
+	size_t len;
+	const char *data = luaL_checklstring(T, 1, &len);
+	const char *name = luaL_optstring(T, 2, "lem-dbus-blob");
+	int fd;
+
+	fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return blob_error(T, -1, "error creating memfd");
+
+	while (len > 0) {
+		ssize_t bytes = write(fd, data, len);
+
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return blob_error(T, fd, "error writing memfd");
+		}
+
+		data += bytes;
+		len -= (size_t)bytes;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, BLOB_SEALS))
+		return blob_error(T, fd, "error sealing memfd");
+
+	lem_dbus_fd_push(T, fd);
+	return 1;
+#else
+	lua_pushnil(T);
+	lua_pushliteral(T, "sealed memfds not supported");
+	return 2;
+#endif
+}
+
+/*
+ * UnixFD:map()
+ *
+ * argument 1: UnixFD object
+ *
+ * Maps a received blob read-only. The UnixFD object may be
+ * closed afterwards, the mapping lives on until the Blob
+ * object is closed or collected.
+ */
+EXPORT int
+lem_dbus_blob_map(lua_State *T)
+{
+	int fd;
+	struct stat st;
+	struct blob *b;
+
+	fd = lem_dbus_fd_get(T, 1);
+	if (fd < 0)
+		return blob_closed(T);
+
+#ifdef BLOB_SEALS
+	/* refuse files the sender can still shrink under our feet,
+	 * that would make us die from SIGBUS while reading */
+	{
+		int seals = fcntl(fd, F_GET_SEALS);
+
+		if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+			lua_pushnil(T);
+			lua_pushliteral(T, "not a sealed memfd");
+			return 2;
+		}
+	}
+#endif
+
+	if (fstat(fd, &st))
+		return blob_error(T, -1, "error getting blob size");
+
+	b = lua_newuserdata(T, sizeof(struct blob));
+	b->len = (size_t)st.st_size;
+	if (b->len == 0)
+		b->data = "";
+	else {
+		void *p = mmap(NULL, b->len, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (p == MAP_FAILED) {
+			b->data = NULL;
+			return blob_error(T, -1, "error mapping blob");
+		}
+		b->data = p;
+	}
+
+	luaL_getmetatable(T, LEM_DBUS_BLOB_META);
+	lua_setmetatable(T, -2);
+	return 1;
+}
+
+static void
+blob_unmap(struct blob *b)
+{
+	if (b->data && b->len > 0)
+		(void)munmap((void *)b->data, b->len);
+	b->data = NULL;
+}
+
+/*
+ * Blob:__gc()
+ */
+static int
+blob_gc(lua_State *T)
+{
+	blob_unmap(lua_touserdata(T, 1));
+	return 0;
+}
+
+/*
+ * Blob:close()
+ */
+static int
+blob_close(lua_State *T)
+{
+	struct blob *b = luaL_checkudata(T, 1, LEM_DBUS_BLOB_META);
+
+	if (b->data == NULL)
+		return blob_closed(T);
+
+	blob_unmap(b);
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Blob:len()
+ */
+static int
+blob_len(lua_State *T)
+{
+	struct blob *b = luaL_checkudata(T, 1, LEM_DBUS_BLOB_META);
+
+	if (b->data == NULL)
+		return blob_closed(T);
+
+	lua_pushnumber(T, (lua_Number)b->len);
+	return 1;
+}
+
+/*
+ * Blob:sub()
+ *
+ * argument 1: blob object
+ * argument 2: start (optional)
+ * argument 3: end (optional)
+ *
+ * Same semantics as string.sub(), but only the
+ * requested range is copied into a Lua string.
+ */
+static int
+blob_sub(lua_State *T)
+{
+	struct blob *b = luaL_checkudata(T, 1, LEM_DBUS_BLOB_META);
+	lua_Number len = (lua_Number)b->len;
+	lua_Number i = luaL_optnumber(T, 2, 1);
+	lua_Number j = luaL_optnumber(T, 3, -1);
+
+	if (b->data == NULL)
+		return blob_closed(T);
+
+	if (i < 0)
+		i += len + 1;
+	if (i < 1)
+		i = 1;
+	if (j < 0)
+		j += len + 1;
+	if (j > len)
+		j = len;
+
+	if (i > j)
+		lua_pushliteral(T, "");
+	else
+		lua_pushlstring(T, b->data + (size_t)i - 1, (size_t)(j - i) + 1);
+	return 1;
+}
+
+static int
+blob_chunks_next(lua_State *T)
+{
+	struct blob *b = lua_touserdata(T, 1);
+	size_t size = (size_t)lua_tonumber(T, lua_upvalueindex(1));
+	size_t offset = (size_t)lua_tonumber(T, 2);
+
+	if (b->data == NULL || offset >= b->len)
+		return 0;
+
+	if (size > b->len - offset)
+		size = b->len - offset;
+
+	lua_pushnumber(T, (lua_Number)(offset + size));
+	lua_pushlstring(T, b->data + offset, size);
+	return 2;
+}
+
+/*
+ * Blob:chunks()
+ *
+ * argument 1: blob object
+ * argument 2: chunk size (optional)
+ *
+ * Iterator for use with the generic for:
+ *   for offset, chunk in blob:chunks(65536) do .. end
+ * offset is the position just after the returned chunk.
+ */
+static int
+blob_chunks(lua_State *T)
+{
+	lua_Number size;
+
+	luaL_checkudata(T, 1, LEM_DBUS_BLOB_META);
+	size = luaL_optnumber(T, 2, 65536);
+	luaL_argcheck(T, size >= 1, 2, "chunk size must be positive");
+
+	lua_pushnumber(T, size);
+	lua_pushcclosure(T, blob_chunks_next, 1);
+	lua_pushvalue(T, 1);
+	lua_pushnumber(T, 0);
+	return 3;
+}
+
+/*
+ * Creates the Blob metatable, registers it and leaves
+ * it on top of the stack.
+ */
+EXPORT void
+lem_dbus_blob_open(lua_State *L)
+{
+	luaL_Reg blob_funcs[] = {
+		{ "__gc",   blob_gc },
+		{ "__len",  blob_len },
+		{ "close",  blob_close },
+		{ "len",    blob_len },
+		{ "sub",    blob_sub },
+		{ "chunks", blob_chunks },
+		{ NULL,     NULL }
+	};
+	luaL_Reg *p;
+
+	luaL_newmetatable(L, LEM_DBUS_BLOB_META);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	for (p = blob_funcs; p->name; p++) {
+		lua_pushcfunction(L, p->func);
+		lua_setfield(L, -2, p->name);
+	}
+}
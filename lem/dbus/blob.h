@@ -0,0 +1,26 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BLOB_H
+#define _BLOB_H
+
+int lem_dbus_blob_new(lua_State *L);
+int lem_dbus_blob_map(lua_State *L);
+void lem_dbus_blob_open(lua_State *L);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AMALG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <lem.h>
+#include <dbus/dbus.h>
+
+#define EXPORT
+#endif
+
+#define LEM_DBUS_CAPTURE_META "lem.dbus.Capture"
+
+/*
+ * A capture file starts with CAPTURE_MAGIC followed by
+ * one record per message:
+ *
+ *   8 bytes  time in microseconds, little endian
+ *   1 byte   direction, '<' received or '>' sent
+ *   4 bytes  length of the message, little endian
+ *   length   the message in wire format
+ */
+#define CAPTURE_MAGIC  "lem-dbus capture 1\n"
+#define CAPTURE_HEADER 13
+
+struct capture {
+	FILE *f;
+};
+
+/*
+ * Creates a new capture file, returns NULL
+ * and sets errno on errors.
+ */
+EXPORT FILE *
+lem_dbus_capture_create(const char *filename)
+{
+	FILE *f = fopen(filename, "wb");
+
+	if (f == NULL)
+		return NULL;
+
+	if (fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC) - 1, f)
+			!= sizeof(CAPTURE_MAGIC) - 1) {
+		(void)fclose(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+/*
+ * Appends msg to the capture file. The message must
+ * have been sent or received already so it has a serial.
+ */
+EXPORT void
+lem_dbus_capture_write(FILE *f, DBusMessage *msg, int sent)
+{
+	unsigned char head[CAPTURE_HEADER];
+	uint64_t usec;
+	char *data;
+	int len;
+	int i;
+
+	if (!dbus_message_marshal(msg, &data, &len))
+		return;
+
+	usec = (uint64_t)(ev_time() * 1e6);
+	for (i = 0; i < 8; i++)
+		head[i] = (unsigned char)(usec >> (8 * i));
+	head[8] = sent ? '>' : '<';
+	for (i = 0; i < 4; i++)
+		head[9 + i] = (unsigned char)((uint32_t)len >> (8 * i));
+
+	(void)fwrite(head, 1, CAPTURE_HEADER, f);
+	(void)fwrite(data, 1, len, f);
+	dbus_free(data);
+}
+
+static int
+capture_closed(lua_State *T)
+{
+	lua_pushnil(T);
+	lua_pushliteral(T, "closed");
+	return 2;
+}
+
+/*
+ * Capture:__gc()
+ */
+static int
+capture_gc(lua_State *T)
+{
+	struct capture *c = lua_touserdata(T, 1);
+
+	if (c->f) {
+		(void)fclose(c->f);
+		c->f = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Capture:read()
+ *
+ * Returns the time, direction ('in' or 'out') and bytes
+ * of the next message, or nil at the end of the file.
+ */
+static int
+capture_read(lua_State *T)
+{
+	struct capture *c = luaL_checkudata(T, 1, LEM_DBUS_CAPTURE_META);
+	unsigned char head[CAPTURE_HEADER];
+	uint64_t usec = 0;
+	uint32_t len = 0;
+	size_t n;
+	char *data;
+	int i;
+
+	if (c->f == NULL)
+		return capture_closed(T);
+
+	n = fread(head, 1, CAPTURE_HEADER, c->f);
+	if (n == 0 && feof(c->f)) {
+		lua_pushnil(T);
+		return 1;
+	}
+	if (n != CAPTURE_HEADER)
+		goto truncated;
+
+	for (i = 7; i >= 0; i--)
+		usec = (usec << 8) | head[i];
+	for (i = 3; i >= 0; i--)
+		len = (len << 8) | head[9 + i];
+
+	/* no message is longer than this, so don't
+	 * trust a length read from a damaged file */
+	if (len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+		goto truncated;
+
+	lua_pushnumber(T, (lua_Number)usec / 1e6);
+	if (head[8] == '>')
+		lua_pushliteral(T, "out");
+	else
+		lua_pushliteral(T, "in");
+
+	data = lem_xmalloc(len);
+	n = fread(data, 1, len, c->f);
+	if (n != len) {
+		free(data);
+		goto truncated;
+	}
+	lua_pushlstring(T, data, len);
+	free(data);
+	return 3;
+
+truncated:
+	lua_pushnil(T);
+	lua_pushliteral(T, "truncated capture file");
+	return 2;
+}
+
+/*
+ * Capture:close()
+ */
+static int
+capture_close(lua_State *T)
+{
+	struct capture *c = luaL_checkudata(T, 1, LEM_DBUS_CAPTURE_META);
+
+	if (c->f == NULL)
+		return capture_closed(T);
+
+	(void)fclose(c->f);
+	c->f = NULL;
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * opencapture()
+ *
+ * argument 1: filename
+ *
+ * Opens a file written by Bus:capture() for reading.
+ */
+EXPORT int
+lem_dbus_capture_new(lua_State *T)
+{
+	const char *filename = luaL_checkstring(T, 1);
+	char magic[sizeof(CAPTURE_MAGIC) - 1];
+	struct capture *c;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error opening %s", filename);
+		return 2;
+	}
+
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	    memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+		(void)fclose(f);
+		lua_pushnil(T);
+		lua_pushfstring(T, "%s is not a capture file", filename);
+		return 2;
+	}
+
+	c = lua_newuserdata(T, sizeof(struct capture));
+	c->f = f;
+	luaL_getmetatable(T, LEM_DBUS_CAPTURE_META);
+	lua_setmetatable(T, -2);
+	return 1;
+}
+
+/*
+ * Creates the Capture metatable, registers it and leaves
+ * it on top of the stack.
+ */
+EXPORT void
+lem_dbus_capture_open(lua_State *L)
+{
+	luaL_Reg capture_funcs[] = {
+		{ "__gc",  capture_gc },
+		{ "read",  capture_read },
+		{ "close", capture_close },
+		{ NULL,    NULL }
+	};
+	luaL_Reg *p;
+
+	luaL_newmetatable(L, LEM_DBUS_CAPTURE_META);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	for (p = capture_funcs; p->name; p++) {
+		lua_pushcfunction(L, p->func);
+		lua_setfield(L, -2, p->name);
+	}
+}
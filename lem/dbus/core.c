@@ -16,7 +16,9 @@
  * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
@@ -25,20 +27,50 @@
 #include <lem.h>
 #include <dbus/dbus.h>
 
+#include "hist.h"
+#include "limit.h"
+#include "flat.h"
+
 #ifdef AMALG
 #include <expat.h>
 
 #define EXPORT static
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "fd.c"
+#include "blob.c"
+#include "hist.c"
+#include "limit.c"
+#include "capture.c"
 #include "add.c"
 #include "push.c"
+#include "message.c"
+#include "match.c"
+#include "latest.c"
 #include "parse.c"
+#include "ring.c"
+#include "flat.c"
 
 #else
 
+#include "fd.h"
+#include "blob.h"
+#include "capture.h"
 #include "add.h"
 #include "push.h"
+#include "message.h"
+#include "match.h"
+#include "latest.h"
 #include "parse.h"
+#include "ring.h"
 
 #endif
 
@@ -53,23 +85,138 @@
 #define LEM_DBUS_OBJECT_TABLE 4
 #define LEM_DBUS_TOP          4
 
+struct bus_stats {
+	unsigned long sent[DBUS_NUM_MESSAGE_TYPES];
+	unsigned long received[DBUS_NUM_MESSAGE_TYPES];
+	unsigned long pending;
+	unsigned long handlers;
+	unsigned long dispatches;
+	unsigned long dropped;
+	unsigned long coalesced;
+	unsigned long shed;
+	unsigned long failed;
+	unsigned long offloaded;
+	double dispatch_time;
+};
+
+/*
+ * State of a connection turned into a monitor. Messages passing
+ * the filters wait in a fixed size ring until Bus:nextmessage()
+ * picks them up, when it is full new messages are dropped.
+ */
+struct monitor {
+	DBusMessage **queue;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	unsigned int types; /* bit mask of message types to keep */
+	char *sender;
+	char *interface;
+	lua_State *T; /* thread waiting in Bus:nextmessage() */
+};
+
+/*
+ * Messages waiting in one of the send classes
+ * until libdbus has room for more outgoing data.
+ */
+enum {
+	SEND_URGENT,
+	SEND_NORMAL,
+	SEND_BULK,
+	SEND_CLASSES
+};
+
+/* feed libdbus while it has fewer bytes than this to write */
+#define SEND_LOWWATER (64*1024)
+
+/* replies larger than this are decoded off the event loop */
+#define OFFLOAD_DEFAULT (256*1024)
+
+struct send_queue {
+	DBusMessage **msgs;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+};
+
 struct bus_object {
 	DBusConnection *conn;
+	struct bus_stats stats;
+	int errors; /* registry reference to the error counters */
+	int inflight; /* registry reference to the shared calls in flight */
+	struct hist_table call_latency;
+	struct hist_table handler_latency;
+	int peer; /* peer-to-peer connection, no bus daemon */
+	FILE *capture; /* set while capturing messages */
+	struct monitor *monitor;
+	int classes; /* registry reference to the send classes */
+	struct send_queue sendq[SEND_CLASSES];
+	struct ev_prepare prepare; /* flushes the changes below */
+	struct watch *dirty; /* watches toggled since the last flush */
+	struct call_link *calls; /* calls waiting for a reply */
+	lua_State *disconnect_T; /* thread in Bus:waitdisconnect() */
+	int disconnected;
+	size_t offload; /* decode larger replies off the event loop */
+	struct call *hello; /* Hello sent by Bus:reopen() */
+	struct held *held; /* sends waiting for the reply to it */
+	struct held **held_tail;
 };
 #define bus_unbox(T, idx) (((struct bus_object *)lua_touserdata(T, idx))->conn)
 
+/*
+ * Each connection points back to its bus object in this data
+ * slot, so replies to messages received on it can be sent
+ * through the bus, even when only the connection is known.
+ */
+static dbus_int32_t bus_slot = -1;
+
+/*
+ * Return the bus object conn belongs to, or NULL
+ * if it is closed or no longer part of one.
+ */
+static struct bus_object *
+bus_fromconn(DBusConnection *conn)
+{
+	struct bus_object *bus = dbus_connection_get_data(conn, bus_slot);
+
+	if (bus == NULL || bus->conn != conn)
+		return NULL;
+
+	return bus;
+}
+
 struct watch {
 	struct ev_io ev;
-	DBusConnection *conn;
+	struct bus_object *bus;
 	DBusWatch *watch;
+	struct watch *next_dirty;
+	int dirty;
 };
 
 struct timeout {
 	struct ev_timer ev;
-	DBusConnection *conn;
+	struct bus_object *bus;
 	DBusTimeout *timeout;
 };
 
+static void
+bus_dispatch(struct bus_object *bus)
+{
+	DBusConnection *conn = bus->conn;
+	ev_tstamp start;
+
+	if (dbus_connection_get_dispatch_status(conn)
+	    != DBUS_DISPATCH_DATA_REMAINS)
+		return;
+
+	start = ev_time();
+	while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS);
+	bus->stats.dispatches++;
+	bus->stats.dispatch_time += ev_time() - start;
+}
+
+static void bus_feed(struct bus_object *bus);
+
 static void
 watch_handler(EV_P_ struct ev_io *ev, int revents)
 {
@@ -88,11 +235,8 @@ watch_handler(EV_P_ struct ev_io *ev, int revents)
 
 	(void)dbus_watch_handle(w->watch, flags);
 
-	if (dbus_connection_get_dispatch_status(w->conn)
-	    == DBUS_DISPATCH_DATA_REMAINS) {
-		while (dbus_connection_dispatch(w->conn)
-		       == DBUS_DISPATCH_DATA_REMAINS);
-	}
+	bus_feed(w->bus);
+	bus_dispatch(w->bus);
 }
 
 static void
@@ -106,11 +250,7 @@ timeout_handler(EV_P_ struct ev_timer *ev, int revents)
 
 	(void)dbus_timeout_handle(t->timeout);
 
-	if (dbus_connection_get_dispatch_status(t->conn)
-	    == DBUS_DISPATCH_DATA_REMAINS) {
-		while (dbus_connection_dispatch(t->conn)
-		       == DBUS_DISPATCH_DATA_REMAINS);
-	}
+	bus_dispatch(t->bus);
 }
 
 static int
@@ -140,8 +280,10 @@ watch_add(DBusWatch *watch, void *data)
 	w = lem_xmalloc(sizeof(struct watch));
 	ev_io_init(&w->ev, watch_handler, dbus_watch_get_unix_fd(watch),
 	           flags_to_revents(dbus_watch_get_flags(watch)));
-	w->conn = data;
+	w->bus = data;
 	w->watch = watch;
+	w->next_dirty = NULL;
+	w->dirty = 0;
 	dbus_watch_set_data(watch, w, NULL);
 
 	if (dbus_watch_get_enabled(watch))
@@ -164,6 +306,13 @@ watch_remove(DBusWatch *watch, void *data)
 		  dbus_watch_get_enabled(watch) ? "true" : "false");
 
 	w = dbus_watch_get_data(watch);
+	if (w->dirty) {
+		struct watch **p = &w->bus->dirty;
+
+		while (*p != w)
+			p = &(*p)->next_dirty;
+		*p = w->next_dirty;
+	}
 	ev_io_stop(LEM_ &w->ev);
 	free(w);
 }
@@ -181,16 +330,65 @@ watch_toggle(DBusWatch *watch, void *data)
 	          dbus_watch_get_flags(watch) & DBUS_WATCH_READABLE ? "READ" : "WRITE",
 		  dbus_watch_get_enabled(watch) ? "true" : "false");
 
+	/* libdbus may toggle a watch back and forth many times
+	 * while sending a burst of messages, so only remember it
+	 * here and update the event loop once before it polls */
 	w = dbus_watch_get_data(watch);
-	if (dbus_watch_get_enabled(watch)) {
-		if (ev_is_active(&w->ev))
-			ev_io_stop(LEM_ &w->ev);
+	if (!w->dirty) {
+		w->dirty = 1;
+		w->next_dirty = w->bus->dirty;
+		w->bus->dirty = w;
+	}
+	ev_prepare_start(LEM_ &w->bus->prepare);
+}
 
-		ev_io_set(LEM_ &w->ev, w->ev.fd,
-		          flags_to_revents(dbus_watch_get_flags(watch)));
-		ev_io_start(LEM_ &w->ev);
-	} else
+static void
+watch_update(struct watch *w)
+{
+	int revents;
+
+	if (!dbus_watch_get_enabled(w->watch)) {
+		ev_io_stop(LEM_ &w->ev);
+		return;
+	}
+
+	revents = flags_to_revents(dbus_watch_get_flags(w->watch));
+	if (ev_is_active(&w->ev)) {
+		if ((w->ev.events & (EV_READ | EV_WRITE)) == revents)
+			return;
 		ev_io_stop(LEM_ &w->ev);
+	}
+
+	ev_io_set(LEM_ &w->ev, w->ev.fd, revents);
+	ev_io_start(LEM_ &w->ev);
+}
+
+/*
+ * Runs once per event loop iteration when there is something to do,
+ * right before the loop polls: toggled watches are brought up to
+ * date and messages queued in the send classes are handed to
+ * libdbus together, most urgent first.
+ */
+static void
+prepare_handler(EV_P_ struct ev_prepare *ev, int revents)
+{
+	struct bus_object *bus = (struct bus_object *)
+		((char *)ev - offsetof(struct bus_object, prepare));
+
+	(void)revents;
+
+	ev_prepare_stop(LEM_ ev);
+
+	bus_feed(bus);
+
+	while (bus->dirty) {
+		struct watch *w = bus->dirty;
+
+		bus->dirty = w->next_dirty;
+		w->next_dirty = NULL;
+		w->dirty = 0;
+		watch_update(w);
+	}
 }
 
 static dbus_bool_t
@@ -207,7 +405,7 @@ timeout_add(DBusTimeout *timeout, void *data)
 	t = lem_xmalloc(sizeof(struct timeout));
 	interval = ((ev_tstamp)dbus_timeout_get_interval(timeout))/1000.0;
 	ev_timer_init(&t->ev, timeout_handler, interval, interval);
-	t->conn = data;
+	t->bus = data;
 	t->timeout = timeout;
 
 	dbus_timeout_set_data(timeout, t, NULL);
@@ -269,6 +467,320 @@ bus_closed(lua_State *T)
 	return 2;
 }
 
+static int
+bus_nofds(lua_State *T)
+{
+	lua_pushnil(T);
+	lua_pushliteral(T, "file descriptor passing not supported");
+	return 2;
+}
+
+/*
+ * Returns true if msg carries file descriptors
+ * which can't be passed over conn.
+ */
+static int
+fds_unsupported(DBusConnection *conn, DBusMessage *msg)
+{
+	return dbus_message_contains_unix_fds(msg) &&
+	       !dbus_connection_can_send_type(conn, DBUS_TYPE_UNIX_FD);
+}
+
+/*
+ * Add msg to the capture file of bus, if any.
+ * Outgoing messages must be captured after sending
+ * them since they only get a serial when sent.
+ */
+static void
+bus_capture_message(struct bus_object *bus, DBusMessage *msg, int sent)
+{
+	if (bus->capture)
+		lem_dbus_capture_write(bus->capture, msg, sent);
+}
+
+static void
+bus_capture_stop(struct bus_object *bus)
+{
+	if (bus->capture) {
+		(void)fclose(bus->capture);
+		bus->capture = NULL;
+	}
+}
+
+static const char *const send_classes[] = {
+	"urgent", "normal", "bulk", NULL
+};
+
+static void
+sendq_push(struct send_queue *q, DBusMessage *msg)
+{
+	if (q->count == q->size) {
+		unsigned int size = q->size ? 2 * q->size : 16;
+		DBusMessage **msgs = lem_xmalloc(size * sizeof(DBusMessage *));
+		unsigned int i;
+
+		for (i = 0; i < q->count; i++)
+			msgs[i] = q->msgs[(q->head + i) % q->size];
+		free(q->msgs);
+		q->msgs = msgs;
+		q->size = size;
+		q->head = 0;
+	}
+
+	q->msgs[(q->head + q->count) % q->size] = msg;
+	q->count++;
+}
+
+static DBusMessage *
+sendq_shift(struct send_queue *q)
+{
+	DBusMessage *msg = q->msgs[q->head];
+
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	return msg;
+}
+
+static void
+sendq_clear(struct bus_object *bus)
+{
+	int c;
+
+	for (c = 0; c < SEND_CLASSES; c++) {
+		struct send_queue *q = &bus->sendq[c];
+
+		while (q->count > 0)
+			dbus_message_unref(sendq_shift(q));
+		free(q->msgs);
+		q->msgs = NULL;
+		q->size = 0;
+		q->head = 0;
+	}
+}
+
+static unsigned int
+sendq_count(struct bus_object *bus)
+{
+	unsigned int count = 0;
+	int c;
+
+	for (c = 0; c < SEND_CLASSES; c++)
+		count += bus->sendq[c].count;
+
+	return count;
+}
+
+/*
+ * Hand queued messages to libdbus, most urgent first,
+ * for as long as it isn't sitting on too much data already.
+ */
+static void
+bus_feed(struct bus_object *bus)
+{
+	int c;
+
+	/* nothing goes out before the reply to Hello */
+	if (bus->hello)
+		return;
+
+	for (c = 0; c < SEND_CLASSES; c++) {
+		struct send_queue *q = &bus->sendq[c];
+
+		while (q->count > 0) {
+			DBusMessage *msg;
+
+			if (bus->conn == NULL ||
+			    dbus_connection_get_outgoing_size(bus->conn)
+			    >= SEND_LOWWATER)
+				return;
+
+			msg = sendq_shift(q);
+			if (dbus_connection_send(bus->conn, msg, NULL)) {
+				bus->stats.sent[dbus_message_get_type(msg)]++;
+				bus_capture_message(bus, msg, 1);
+			}
+			dbus_message_unref(msg);
+		}
+	}
+}
+
+/*
+ * Return the send class set with Bus:setpriority() for messages
+ * of interface and member, or -1 if no classes are set on bus.
+ */
+static int
+bus_sendclass(lua_State *T, struct bus_object *bus,
+              const char *interface, const char *member)
+{
+	int class = SEND_NORMAL;
+
+	if (bus->classes == LUA_NOREF)
+		return -1;
+
+	lua_rawgeti(T, LUA_REGISTRYINDEX, bus->classes);
+	lua_pushfstring(T, "%s.%s",
+	                interface ? interface : "",
+	                member    ? member    : "");
+	lua_rawget(T, -2);
+	if (lua_isnil(T, -1)) {
+		lua_pop(T, 1);
+		lua_pushstring(T, interface ? interface : "");
+		lua_rawget(T, -2);
+	}
+	if (lua_type(T, -1) == LUA_TNUMBER)
+		class = (int)lua_tointeger(T, -1);
+	lua_pop(T, 2);
+
+	return class;
+}
+
+/*
+ * Send msg on bus, or queue it in the given send class to be
+ * sent before the event loop polls again. Returns 0 if out of memory.
+ * While Hello is waiting for its reply everything is queued.
+ */
+static int
+bus_send(struct bus_object *bus, DBusMessage *msg, int class)
+{
+	if (class < 0) {
+		if (bus->hello)
+			class = SEND_NORMAL;
+		else {
+			if (!dbus_connection_send(bus->conn, msg, NULL))
+				return 0;
+			bus->stats.sent[dbus_message_get_type(msg)]++;
+			bus_capture_message(bus, msg, 1);
+			return 1;
+		}
+	}
+
+	sendq_push(&bus->sendq[class], dbus_message_ref(msg));
+	ev_prepare_start(LEM_ &bus->prepare);
+	return 1;
+}
+
+/*
+ * Bus:setpriority()
+ *
+ * argument 1: bus object
+ * argument 2: interface
+ * argument 3: member (optional)
+ * argument 4: 'urgent', 'normal' or 'bulk' (optional)
+ *
+ * Sets the send class of signals and method replies of
+ * the interface, or just of one member of it. Messages of
+ * a more urgent class are handed to libdbus first whenever
+ * there is more to send than the socket takes right away.
+ * Without a class the setting is removed again.
+ */
+static int
+bus_setpriority(lua_State *T)
+{
+	struct bus_object *bus;
+	const char *interface;
+	const char *member;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	interface = luaL_checkstring(T, 2);
+	member = luaL_optstring(T, 3, NULL);
+
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	if (bus->classes == LUA_NOREF) {
+		lua_newtable(T);
+		bus->classes = luaL_ref(T, LUA_REGISTRYINDEX);
+	}
+
+	lua_rawgeti(T, LUA_REGISTRYINDEX, bus->classes);
+	if (member)
+		lua_pushfstring(T, "%s.%s", interface, member);
+	else
+		lua_pushstring(T, interface);
+	if (lua_isnoneornil(T, 4))
+		lua_pushnil(T);
+	else
+		lua_pushinteger(T, luaL_checkoption(T, 4, NULL, send_classes));
+	lua_rawset(T, -3);
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:setoffload()
+ *
+ * argument 1: bus object
+ * argument 2: size in bytes
+ *
+ * Replies larger than this are walked on one of lem's worker
+ * threads, leaving only the Lua values to be built on the event
+ * loop. The size is estimated from the arrays and strings at
+ * the top level of the reply, and 0 turns this off.
+ */
+static int
+bus_setoffload(lua_State *T)
+{
+	struct bus_object *bus;
+	lua_Number size;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	size = luaL_checknumber(T, 2);
+	luaL_argcheck(T, size >= 0, 2, "size must not be negative");
+
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	bus->offload = (size_t)size;
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:cansendfd()
+ *
+ * libdbus negotiates unix fd passing while authenticating
+ * whenever the transport supports it, so this is only
+ * meaningful once the connection is up (eg. after Hello).
+ *
+ * argument 1: bus object
+ */
+static int
+bus_cansendfd(lua_State *T)
+{
+	DBusConnection *conn;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	conn = bus_unbox(T, 1);
+	if (conn == NULL)
+		return bus_closed(T);
+
+	lua_pushboolean(T, dbus_connection_can_send_type(conn,
+	                                                 DBUS_TYPE_UNIX_FD));
+	return 1;
+}
+
+/*
+ * Bus:ispeer()
+ *
+ * Returns true if the bus is a direct connection
+ * to a peer, rather than to a bus daemon.
+ *
+ * argument 1: bus object
+ */
+static int
+bus_ispeer(lua_State *T)
+{
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	if (bus_unbox(T, 1) == NULL)
+		return bus_closed(T);
+
+	lua_pushboolean(T, ((struct bus_object *)lua_touserdata(T, 1))->peer);
+	return 1;
+}
+
 /*
  * Bus:signaltable()
  *
@@ -316,6 +828,7 @@ bus_objecttable(lua_State *T)
 static int
 bus_signal(lua_State *T)
 {
+	struct bus_object *bus;
 	DBusConnection *conn;
 	const char *path;
 	const char *interface;
@@ -344,7 +857,13 @@ bus_signal(lua_State *T)
 		return luaL_error(T, "%s", lua_tostring(T, -1));
 	}
 
-	if (!dbus_connection_send(conn, msg, NULL))
+	if (fds_unsupported(conn, msg)) {
+		dbus_message_unref(msg);
+		return bus_nofds(T);
+	}
+
+	bus = lua_touserdata(T, 1);
+	if (!bus_send(bus, msg, bus_sendclass(T, bus, interface, name)))
 		goto oom;
 
 	dbus_message_unref(msg);
@@ -359,87 +878,309 @@ oom:
 	return 2;
 }
 
+/*
+ * Count an error by name in the "received" or "sent"
+ * table of the error counters.
+ */
 static void
-bus_call_cb(DBusPendingCall *pending, void *data)
+stats_error(lua_State *T, struct bus_object *bus,
+            const char *which, const char *name)
 {
-	lua_State *T = data;
-	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
-	int nargs;
+	lua_rawgeti(T, LUA_REGISTRYINDEX, bus->errors);
+	lua_getfield(T, -1, which);
+	lua_getfield(T, -1, name);
+	lua_pushnumber(T, lua_tonumber(T, -1) + 1);
+	lua_setfield(T, -3, name);
+	lua_pop(T, 3);
+}
 
-	dbus_pending_call_unref(pending);
+/*
+ * Calls waiting for a reply are linked into a list on their bus
+ * together with their destination, so Bus:failcalls() can give
+ * up on every call to a name at once. The destination is copied
+ * to the end of the same allocation as the call.
+ */
+enum {
+	CALL_PLAIN,
+	CALL_SHARED,
+	CALL_FORWARD /* made by Bus:forward() */
+};
 
-	lem_debug("received return(%s)", dbus_message_get_signature(msg));
+struct call_link {
+	struct call_link *next;
+	struct call_link **prev;
+	DBusPendingCall *pending;
+	const char *destination;
+	int kind;
+};
 
-	if (msg == NULL) {
-		lua_pushnil(T);
-		lua_pushliteral(T, "null reply");
-		nargs = 2;
-	} else {
-		switch (dbus_message_get_type(msg)) {
-		case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-			nargs = lem_dbus_push_arguments(T, msg);
-			break;
+static size_t
+calls_destlen(DBusMessage *msg)
+{
+	const char *destination = dbus_message_get_destination(msg);
 
-		case DBUS_MESSAGE_TYPE_ERROR:
-			lua_pushnil(T);
-			{
-				DBusError err;
+	return destination ? strlen(destination) + 1 : 1;
+}
 
-				dbus_error_init(&err);
-				dbus_set_error_from_message(&err, msg);
-				lua_pushstring(T, err.message);
-				dbus_error_free(&err);
-			}
-			nargs = 2;
-			break;
+static void
+calls_insert(struct bus_object *bus, struct call_link *l,
+             DBusPendingCall *pending, DBusMessage *msg, char *buf)
+{
+	const char *destination = dbus_message_get_destination(msg);
+
+	strcpy(buf, destination ? destination : "");
+	l->destination = buf;
+	l->pending = pending;
+	l->next = bus->calls;
+	if (l->next)
+		l->next->prev = &l->next;
+	l->prev = &bus->calls;
+	bus->calls = l;
+}
 
-		default:
-			lua_pushnil(T);
-			lua_pushliteral(T, "unknown reply");
-			nargs = 2;
-		}
-		dbus_message_unref(msg);
-	}
+static void
+calls_remove(struct call_link *l)
+{
+	if (l->prev == NULL)
+		return;
 
-	lem_queue(T, nargs);
+	*l->prev = l->next;
+	if (l->next)
+		l->next->prev = l->prev;
+	l->prev = NULL;
 }
 
 /*
- * Bus:call()
- *
- * argument 1: bus object
- * argument 2: destination
- * argument 3: path
- * argument 4: interface
- * argument 5: method
- * argument 6: signature (optional)
- * ...
+ * Forget the list when the bus goes away, the
+ * calls in it may still finish after that.
+ */
+static void
+calls_detach(struct bus_object *bus)
+{
+	struct call_link *l = bus->calls;
+
+	while (l) {
+		struct call_link *next = l->next;
+
+		l->next = NULL;
+		l->prev = NULL;
+		l = next;
+	}
+	bus->calls = NULL;
+}
+
+struct call {
+	struct call_link link;
+	lua_State *T;
+	struct bus_object *bus;
+	struct histogram *latency;
+	ev_tstamp start;
+};
+
+/*
+ * Count the reply msg to a call made on bus, and push the
+ * values to return to the caller onto T. Returns how many.
  */
 static int
-bus_call(lua_State *T)
+call_reply(lua_State *T, struct bus_object *bus, DBusMessage *msg)
+{
+	int nargs;
+
+	bus->stats.pending--;
+	if (msg) {
+		bus->stats.received[dbus_message_get_type(msg)]++;
+		bus_capture_message(bus, msg, 0);
+	}
+
+	lem_debug("received return(%s)", dbus_message_get_signature(msg));
+
+	if (msg == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "null reply");
+		return 2;
+	}
+
+	switch (dbus_message_get_type(msg)) {
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		nargs = lem_dbus_push_arguments(T, msg);
+		break;
+
+	case DBUS_MESSAGE_TYPE_ERROR:
+		lua_pushnil(T);
+		{
+			DBusError err;
+
+			dbus_error_init(&err);
+			dbus_set_error_from_message(&err, msg);
+			stats_error(T, bus, "received", err.name);
+			lua_pushstring(T, err.message);
+			dbus_error_free(&err);
+		}
+		nargs = 2;
+		break;
+
+	default:
+		lua_pushnil(T);
+		lua_pushliteral(T, "unknown reply");
+		nargs = 2;
+	}
+	dbus_message_unref(msg);
+
+	return nargs;
+}
+
+/*
+ * Wake up the callers waiting for the same reply, the values
+ * to return are on top of the stack of the first one.
+ */
+static void
+call_deliver(lua_State **waiters, unsigned int n, int nargs)
+{
+	lua_State *T = waiters[0];
+	int top = lua_gettop(T);
+	unsigned int i;
+	int j;
+
+	/* the reply is decoded once, so every waiter
+	 * gets the very same values, tables included */
+	for (i = 1; i < n; i++) {
+		lua_State *W = waiters[i];
+
+		for (j = top - nargs + 1; j <= top; j++)
+			lua_pushvalue(T, j);
+		lua_xmove(T, W, nargs);
+		lem_queue(W, nargs);
+	}
+
+	lem_queue(T, nargs);
+}
+
+/*
+ * Large replies are walked on one of lem's worker threads,
+ * so only building the Lua values is left for the event loop.
+ */
+struct offload {
+	struct lem_async a;
+	DBusMessage *msg;
+	struct histogram *latency;
+	ev_tstamp start;
+	lua_State *T;
+	lua_State **waiters;
+	unsigned int nwaiters;
+	struct flat flat;
+};
+
+static void
+offload_work(struct lem_async *a)
+{
+	struct offload *o = (struct offload *)a;
+
+	lem_dbus_flat_walk(&o->flat, o->msg);
+}
+
+static void
+offload_reap(struct lem_async *a)
+{
+	struct offload *o = (struct offload *)a;
+	int nargs;
+
+	nargs = lem_dbus_flat_push(o->waiters[0], &o->flat);
+	lem_dbus_flat_free(&o->flat);
+	dbus_message_unref(o->msg);
+	lem_dbus_hist_record(o->latency, ev_time() - o->start);
+
+	call_deliver(o->waiters, o->nwaiters, nargs);
+	if (o->waiters != &o->T)
+		free(o->waiters);
+	free(o);
+}
+
+/*
+ * Hand the reply msg over to a worker thread if it is large
+ * enough. The waiters are taken over unless waiters is NULL,
+ * which means T is the only one. Returns 0 if msg is small or
+ * can't be walked off the event loop.
+ */
+static int
+call_offload(struct bus_object *bus, DBusMessage *msg,
+             struct histogram *latency, ev_tstamp start,
+             lua_State *T, lua_State **waiters, unsigned int nwaiters)
+{
+	struct offload *o;
+
+	if (bus->offload == 0 || msg == NULL ||
+	    dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+	    dbus_message_contains_unix_fds(msg) ||
+	    lem_dbus_flat_size(msg) < bus->offload)
+		return 0;
+
+	bus->stats.pending--;
+	bus->stats.received[DBUS_MESSAGE_TYPE_METHOD_RETURN]++;
+	bus->stats.offloaded++;
+	bus_capture_message(bus, msg, 0);
+
+	lem_debug("offloading return(%s)", dbus_message_get_signature(msg));
+
+	o = lem_xmalloc(sizeof(struct offload));
+	o->msg = msg;
+	o->latency = latency;
+	o->start = start;
+	o->T = T;
+	if (waiters) {
+		o->waiters = waiters;
+		o->nwaiters = nwaiters;
+	} else {
+		o->waiters = &o->T;
+		o->nwaiters = 1;
+	}
+	lem_async_do(&o->a, offload_work, offload_reap);
+	return 1;
+}
+
+static void
+bus_call_cb(DBusPendingCall *pending, void *data)
+{
+	struct call *c = data;
+	lua_State *T = c->T;
+	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
+	int nargs;
+
+	calls_remove(&c->link);
+	dbus_pending_call_unref(pending);
+
+	if (call_offload(c->bus, msg, c->latency, c->start, T, NULL, 0))
+		return;
+
+	nargs = call_reply(T, c->bus, msg);
+	lem_dbus_hist_record(c->latency, ev_time() - c->start);
+	lem_queue(T, nargs);
+}
+
+/*
+ * Create the method call described by the arguments
+ * given to Bus:call(). Raises an error if the values
+ * don't match the signature, or when err isn't NULL
+ * points it at the error message and returns NULL.
+ * Returns NULL if out of memory.
+ */
+static DBusMessage *
+call_message(lua_State *T, const char **err)
 {
-	DBusConnection *conn;
 	const char *destination;
 	const char *path;
 	const char *interface;
 	const char *method;
 	const char *signature;
 	DBusMessage *msg;
-	DBusPendingCall *pending;
 
-	luaL_checktype(T, 1, LUA_TUSERDATA);
-	destination = luaL_checkstring(T, 2);
+	destination = luaL_optstring(T, 2, NULL);
 	path        = luaL_checkstring(T, 3);
 	interface   = luaL_checkstring(T, 4);
 	method      = luaL_checkstring(T, 5);
 	signature   = luaL_optstring(T, 6, NULL);
 
-	conn = bus_unbox(T, 1);
-	if (conn == NULL)
-		return bus_closed(T);
-
 	lem_debug("calling\n  %s\n  %s\n  %s\n  %s(%s)",
-	          destination, path, interface, method,
+	          destination ? destination : "", path, interface, method,
 		  signature ? signature : "");
 
 	/* create a new method call and check for errors */
@@ -448,17 +1189,129 @@ bus_call(lua_State *T)
 	                                   interface,
 	                                   method);
 	if (msg == NULL)
-		goto oom;
+		return NULL;
 
 	/* add arguments if a signature was provided */
 	if (signature && signature[0] != '\0' &&
-	    lem_dbus_add_arguments(T, 7, signature, msg))
-		return luaL_error(T, "%s", lua_tostring(T, -1));
+	    lem_dbus_add_arguments(T, 7, signature, msg)) {
+		dbus_message_unref(msg);
+		if (err == NULL)
+			luaL_error(T, "%s", lua_tostring(T, -1));
+		*err = lua_tostring(T, -1);
+		return NULL;
+	}
+
+	return msg;
+}
+
+static struct histogram *
+call_latency(struct bus_object *bus, DBusMessage *msg)
+{
+	const char *destination = dbus_message_get_destination(msg);
+
+	return lem_dbus_hist_get(&bus->call_latency,
+	                         destination ? destination : "",
+	                         dbus_message_get_interface(msg),
+	                         dbus_message_get_member(msg));
+}
+
+/*
+ * Send the method call msg on bus, the reply is handed
+ * to notify for T. Returns NULL if out of memory.
+ */
+static struct call *
+call_send(lua_State *T, struct bus_object *bus, DBusMessage *msg,
+          DBusPendingCallNotifyFunction notify)
+{
+	DBusPendingCall *pending;
+	struct call *c;
+	ev_tstamp start;
+
+	start = ev_time();
+	if (!dbus_connection_send_with_reply(bus->conn, msg, &pending, -1))
+		return NULL;
+
+	c = lem_xmalloc(sizeof(struct call) + calls_destlen(msg));
+	c->T = T;
+	c->bus = bus;
+	c->latency = call_latency(bus, msg);
+	c->start = start;
+	if (!dbus_pending_call_set_notify(pending, notify, c, free)) {
+		free(c);
+		return NULL;
+	}
+
+	c->link.kind = CALL_PLAIN;
+	calls_insert(bus, &c->link, pending, msg, (char *)(c + 1));
+	bus->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
+	bus->stats.pending++;
+	bus_capture_message(bus, msg, 1);
+	return c;
+}
+
+/*
+ * Method calls made while Hello is waiting for its reply
+ * are held back and sent in order once it arrives. Calls
+ * made with Bus:forward() keep the message they came from.
+ */
+struct held {
+	struct held *next;
+	lua_State *T;
+	DBusMessage *msg;
+	DBusMessage *orig;
+	DBusConnection *from;
+};
+
+/*
+ * Hold back msg on bus, taking over the reference,
+ * and let T wait until it is sent.
+ */
+static int
+bus_hold(lua_State *T, struct bus_object *bus, DBusMessage *msg,
+         DBusMessage *orig, DBusConnection *from)
+{
+	struct held *h = lem_xmalloc(sizeof(struct held));
+
+	h->next = NULL;
+	h->T = T;
+	h->msg = msg;
+	h->orig = orig ? dbus_message_ref(orig) : NULL;
+	h->from = from ? dbus_connection_ref(from) : NULL;
+	*bus->held_tail = h;
+	bus->held_tail = &h->next;
+	return lua_yield(T, 0);
+}
+
+/*
+ * Send the method call described by the arguments, and
+ * wait for the reply. If safe is set values not matching
+ * the signature return nil and the error message.
+ */
+static int
+call_start(lua_State *T, int safe)
+{
+	struct bus_object *bus;
+	DBusMessage *msg;
+	const char *err = NULL;
 
-	if (!dbus_connection_send_with_reply(conn, msg, &pending, -1))
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	msg = call_message(T, safe ? &err : NULL);
+	if (msg == NULL)
 		goto oom;
 
-	if (!dbus_pending_call_set_notify(pending, bus_call_cb, T, NULL))
+	if (fds_unsupported(bus->conn, msg)) {
+		dbus_message_unref(msg);
+		return bus_nofds(T);
+	}
+
+	if (bus->hello)
+		return bus_hold(T, bus, msg, NULL, NULL);
+
+	if (call_send(T, bus, msg, bus_call_cb) == NULL)
 		goto oom;
 
 	dbus_message_unref(msg);
@@ -468,410 +1321,2981 @@ oom:
 	if (msg)
 		dbus_message_unref(msg);
 	lua_pushnil(T);
-	lua_pushliteral(T, "out of memory");
+	lua_pushstring(T, err ? err : "out of memory");
 	return 2;
 }
 
-static DBusHandlerResult
-signal_handler(lua_State *S, DBusMessage *msg)
+/*
+ * Bus:call()
+ *
+ * argument 1: bus object
+ * argument 2: destination (nil on peer connections)
+ * argument 3: path
+ * argument 4: interface
+ * argument 5: method
+ * argument 6: signature (optional)
+ * ...
+ */
+static int
+bus_call(lua_State *T)
 {
-	lua_State *T;
-	const char *path = dbus_message_get_path(msg);
-	const char *interface = dbus_message_get_interface(msg);
-	const char *member = dbus_message_get_member(msg);
-
-	lem_debug("received signal\n  %s\n  %s\n  %s(%s)",
-	          path, interface, member,
-	          dbus_message_get_signature(msg));
-
-	/* NOTE: this magic string representation of an
-	 * incoming signal must match the one in the Lua code */
-	lua_pushfstring(S, "%s\n%s\n%s",
-	                path      ? path      : "",
-	                interface ? interface : "",
-	                member    ? member    : "");
+	return call_start(T, 0);
+}
 
-	lua_rawget(S, LEM_DBUS_SIGNAL_TABLE);
-	if (lua_type(S, -1) != LUA_TFUNCTION) {
-		lua_settop(S, LEM_DBUS_TOP);
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-	}
+/*
+ * Bus:trycall()
+ *
+ * Takes the same arguments as Bus:call(), but returns nil
+ * and the error message instead of raising an error if
+ * the values don't match the signature.
+ */
+static int
+bus_trycall(lua_State *T)
+{
+	return call_start(T, 1);
+}
 
-	/* create new thread */
-	T = lem_newthread();
-	lua_xmove(S, T, 1);
+/*
+ * Calls made with Bus:callshared() while an identical call
+ * is in flight wait for its reply instead of sending their own.
+ */
+struct shared_call {
+	struct call_link link;
+	struct bus_object *bus;
+	struct histogram *latency;
+	ev_tstamp start;
+	char *key;
+	size_t keylen;
+	unsigned int nwaiters;
+	unsigned int size;
+	lua_State **waiters;
+};
 
-	lem_queue(T, lem_dbus_push_arguments(T, msg));
+static void
+shared_call_free(void *data)
+{
+	struct shared_call *s = data;
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	free(s->key);
+	free(s->waiters);
+	free(s);
 }
 
-struct message_object {
-	DBusMessage *msg;
-};
-
-static int
-message_gc(lua_State *T)
+static void
+shared_call_cb(DBusPendingCall *pending, void *data)
 {
-	struct message_object *m = lua_touserdata(T, 1);
+	struct shared_call *s = data;
+	struct bus_object *bus = s->bus;
+	lua_State *T = s->waiters[0];
+	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
+	int nargs;
 
-	if (m->msg) {
-		dbus_message_unref(m->msg);
-		m->msg = NULL;
+	calls_remove(&s->link);
+	dbus_pending_call_unref(pending);
+
+	/* later calls must not join this one anymore */
+	lua_rawgeti(T, LUA_REGISTRYINDEX, bus->inflight);
+	lua_pushlstring(T, s->key, s->keylen);
+	lua_pushnil(T);
+	lua_rawset(T, -3);
+	lua_pop(T, 1);
+
+	if (call_offload(bus, msg, s->latency, s->start,
+	                 T, s->waiters, s->nwaiters)) {
+		s->waiters = NULL;
+		return;
 	}
 
-	return 0;
+	nargs = call_reply(T, bus, msg);
+	lem_dbus_hist_record(s->latency, ev_time() - s->start);
+	call_deliver(s->waiters, s->nwaiters, nargs);
 }
 
+/*
+ * Send the method call described by the arguments, or wait
+ * for the reply to an identical call already sent. Values
+ * not matching the signature are handled as in call_start().
+ */
 static int
-message_reply(lua_State *T)
+callshared_start(lua_State *T, int safe)
 {
-	DBusConnection *conn = bus_unbox(T, lua_upvalueindex(1));
-	struct message_object *m;
+	struct bus_object *bus;
 	DBusMessage *msg;
-	DBusMessage *reply;
+	DBusMessage *copy;
+	DBusPendingCall *pending;
+	struct shared_call *s;
+	ev_tstamp start;
+	char *key;
+	int keylen;
+	const char *err = NULL;
 
-	if (conn == NULL) /* connection closed */
-		return 0;
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
 
-	m = lua_touserdata(T, lua_upvalueindex(2));
-	msg = m->msg;
+	msg = call_message(T, safe ? &err : NULL);
 	if (msg == NULL)
-		return luaL_error(T, "send reply called twice");
-
-	m->msg = NULL;
+		goto oom;
 
-	/* check if the method returned an error */
-	if (lua_gettop(T) > 0 && lua_isnil(T, 1)) {
-		const char *name = luaL_checkstring(T, 2);
-		const char *message = luaL_optstring(T, 3, NULL);
+	/* file descriptors aren't part of the wire format,
+	 * so calls passing them are never shared, nor are
+	 * calls held back until Hello is answered */
+	if (bus->hello || dbus_message_contains_unix_fds(msg)) {
+		dbus_message_unref(msg);
+		return call_start(T, safe);
+	}
 
-		if (message && message[0] == '\0')
-			message = NULL;
+	/* the key is the whole call in wire format, marshalling
+	 * locks the message so it is done on a copy */
+	copy = dbus_message_copy(msg);
+	if (copy == NULL)
+		goto oom;
+	if (!dbus_message_marshal(copy, &key, &keylen)) {
+		dbus_message_unref(copy);
+		goto oom;
+	}
+	dbus_message_unref(copy);
+
+	lua_rawgeti(T, LUA_REGISTRYINDEX, bus->inflight);
+	lua_pushlstring(T, key, keylen);
+	dbus_free(key);
+	lua_pushvalue(T, -1);
+	lua_rawget(T, -3);
+	s = lua_touserdata(T, -1);
+	lua_pop(T, 1);
 
-		reply = dbus_message_new_error(msg, name, message);
+	if (s) {
 		dbus_message_unref(msg);
-		if (reply == NULL)
-			return 0;
-	} else {
-		const char *signature = luaL_optstring(T, 1, NULL);
+		if (s->nwaiters == s->size) {
+			lua_State **waiters = lem_xmalloc(2 * s->size *
+			                                  sizeof(lua_State *));
+
+			memcpy(waiters, s->waiters, s->size * sizeof(lua_State *));
+			free(s->waiters);
+			s->waiters = waiters;
+			s->size *= 2;
+		}
+		s->waiters[s->nwaiters++] = T;
+		bus->stats.coalesced++;
+		return lua_yield(T, 0);
+	}
 
-		reply = dbus_message_new_method_return(msg);
+	start = ev_time();
+	if (!dbus_connection_send_with_reply(bus->conn, msg, &pending, -1))
+		goto oom;
+
+	s = lem_xmalloc(sizeof(struct shared_call) + calls_destlen(msg));
+	s->bus = bus;
+	s->latency = call_latency(bus, msg);
+	s->start = start;
+	s->keylen = lua_objlen(T, -1);
+	s->key = lem_xmalloc(s->keylen);
+	memcpy(s->key, lua_tostring(T, -1), s->keylen);
+	s->nwaiters = 1;
+	s->size = 4;
+	s->waiters = lem_xmalloc(s->size * sizeof(lua_State *));
+	s->waiters[0] = T;
+	if (!dbus_pending_call_set_notify(pending, shared_call_cb, s,
+	                                  shared_call_free)) {
+		shared_call_free(s);
+		goto oom;
+	}
+
+	/* inflight[key] = s */
+	lua_pushlightuserdata(T, s);
+	lua_rawset(T, -3);
+
+	s->link.kind = CALL_SHARED;
+	calls_insert(bus, &s->link, pending, msg, (char *)(s + 1));
+	bus->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
+	bus->stats.pending++;
+	bus_capture_message(bus, msg, 1);
+	dbus_message_unref(msg);
+	return lua_yield(T, 0);
+
+oom:
+	if (msg)
 		dbus_message_unref(msg);
-		if (reply == NULL)
-			return 0;
+	lua_pushnil(T);
+	lua_pushstring(T, err ? err : "out of memory");
+	return 2;
+}
 
-		if (signature && signature[0] != '\0' &&
-		    lem_dbus_add_arguments(T, 2, signature, reply)) {
-			dbus_message_unref(reply);
-			/* add_arguments() pushes its own error message */
-			return luaL_error(T, "%s", lua_tostring(T, -1));
+/*
+ * Bus:callshared()
+ *
+ * Takes the same arguments as Bus:call(). If an identical
+ * call is already waiting for a reply this waits for the
+ * same reply instead of sending the call again.
+ */
+static int
+bus_callshared(lua_State *T)
+{
+	return callshared_start(T, 0);
+}
+
+/*
+ * Bus:trycallshared()
+ *
+ * Like Bus:callshared(), but returns nil and the error
+ * message instead of raising an error if the values
+ * don't match the signature.
+ */
+static int
+bus_trycallshared(lua_State *T)
+{
+	return callshared_start(T, 1);
+}
+
+static void hello_release(struct bus_object *bus, const char *err);
+static void forward_fail(struct call_link *l, const char *message);
+static void forward_cancel(struct bus_object *bus, const char *message);
+
+/*
+ * Wake up the callers waiting for the call l
+ * with nil and the error message.
+ */
+static void
+call_fail(lua_State *T, struct call_link *l, const char *message)
+{
+	if (l->kind == CALL_FORWARD) {
+		forward_fail(l, message);
+	} else if (l->kind == CALL_SHARED) {
+		struct shared_call *s = (struct shared_call *)l;
+		unsigned int i;
+
+		lua_rawgeti(T, LUA_REGISTRYINDEX, s->bus->inflight);
+		lua_pushlstring(T, s->key, s->keylen);
+		lua_pushnil(T);
+		lua_rawset(T, -3);
+		lua_pop(T, 1);
+
+		for (i = 0; i < s->nwaiters; i++) {
+			lua_State *W = s->waiters[i];
+
+			lua_pushnil(W);
+			lua_pushstring(W, message);
+			lem_queue(W, 2);
 		}
+	} else {
+		struct call *c = (struct call *)l;
+		lua_State *W = c->T;
+
+		/* what was held back for Hello fails with it */
+		if (c->bus->hello == c)
+			hello_release(c->bus, message);
+
+		lua_pushnil(W);
+		lua_pushstring(W, message);
+		lem_queue(W, 2);
 	}
+}
 
-	dbus_connection_send(conn, reply, NULL);
-	dbus_message_unref(reply);
-	return 0;
+/*
+ * Bus:failcalls()
+ *
+ * argument 1: bus object
+ * argument 2: destination
+ * argument 3: error message (optional)
+ *
+ * Gives up on every call to destination still waiting for
+ * a reply, so the callers get nil and the error message
+ * right away instead of when the call times out.
+ * Returns the number of calls given up on.
+ */
+static int
+bus_failcalls(lua_State *T)
+{
+	struct bus_object *bus;
+	const char *destination;
+	struct call_link *l;
+	struct call_link *next;
+	unsigned long n = 0;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	destination = luaL_checkstring(T, 2);
+	if (lua_isnoneornil(T, 3)) {
+		lua_settop(T, 2);
+		lua_pushliteral(T, "name has no owner");
+	} else {
+		luaL_checkstring(T, 3);
+		lua_settop(T, 3);
+	}
+
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	for (l = bus->calls; l; l = next) {
+		DBusPendingCall *pending = l->pending;
+
+		next = l->next;
+		if (strcmp(l->destination, destination) != 0)
+			continue;
+
+		/* once cancelled the notify function is never
+		 * called, and the last unref frees the call */
+		calls_remove(l);
+		dbus_pending_call_cancel(pending);
+		call_fail(T, l, lua_tostring(T, 3));
+		dbus_pending_call_unref(pending);
+		n++;
+	}
+
+	bus->stats.pending -= n;
+	bus->stats.failed += n;
+	lua_pushnumber(T, (lua_Number)n);
+	return 1;
+}
+
+/*
+ * Replace a Match object on top of the stack by its
+ * handler. Returns 0 if msg doesn't match.
+ */
+static int
+signal_match(lua_State *S, DBusMessage *msg)
+{
+	struct match *m = lem_dbus_match_get(S, -1);
+
+	if (m == NULL)
+		return 1;
+
+	if (!lem_dbus_match_test(m, msg))
+		return 0;
+
+	lem_dbus_match_push_handler(S, -1);
+	lua_replace(S, -2);
+	return 1;
+}
+
+/*
+ * If the handler on top of the stack is a Latest object
+ * leave msg there for it. Returns 0 if it isn't.
+ */
+static int
+signal_latest(lua_State *S, DBusMessage *msg)
+{
+	struct latest *l = lem_dbus_latest_get(S, -1);
+
+	if (l == NULL)
+		return 0;
+
+	lem_dbus_latest_push(l, msg);
+	return 1;
+}
+
+/*
+ * Replace the list of handlers on top of the stack by a list
+ * of only those whose Match objects, if any, match msg, and
+ * which aren't Latest objects taking msg on their own.
+ * Returns 0 if none are left.
+ */
+static int
+signal_filter(lua_State *S, DBusMessage *msg)
+{
+	int list = lua_gettop(S);
+	int n = (int)lua_objlen(S, list);
+	int count = 0;
+	int i;
+
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(S, list, i);
+		if (lua_type(S, -1) == LUA_TUSERDATA)
+			break;
+		lua_pop(S, 1);
+	}
+	if (i > n) /* nothing to filter */
+		return 1;
+	lua_pop(S, 1);
+
+	lua_createtable(S, n, 0);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(S, list, i);
+		if (lua_type(S, -1) == LUA_TUSERDATA &&
+		    (!signal_match(S, msg) || signal_latest(S, msg) ||
+		     lua_type(S, -1) != LUA_TFUNCTION)) {
+			lua_pop(S, 1);
+			continue;
+		}
+		lua_rawseti(S, list + 1, ++count);
+	}
+
+	if (count == 0)
+		return 0;
+
+	if (count == 1)
+		lua_rawgeti(S, list + 1, 1);
+	else {
+		lua_pushvalue(S, list + 1);
+		lua_getmetatable(S, list);
+		lua_setmetatable(S, -2);
+	}
+	lua_replace(S, list);
+	lua_settop(S, list);
+	return 1;
 }
 
 static DBusHandlerResult
-method_call_handler(lua_State *S, DBusMessage *msg)
+signal_handler(lua_State *S, DBusMessage *msg)
 {
 	lua_State *T;
-	struct message_object *m;
 	const char *path = dbus_message_get_path(msg);
 	const char *interface = dbus_message_get_interface(msg);
 	const char *member = dbus_message_get_member(msg);
 
-	lem_debug("received call\n  %s\n  %s\n  %s(%s)",
+	lem_debug("received signal\n  %s\n  %s\n  %s(%s)",
 	          path, interface, member,
-		  dbus_message_get_signature(msg));
-
-	lua_pushstring(S, path ? path : "");
-	lua_rawget(S, LEM_DBUS_OBJECT_TABLE);
-	if (lua_type(S, -1) != LUA_TTABLE) {
-		lua_settop(S, LEM_DBUS_TOP);
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-	}
+	          dbus_message_get_signature(msg));
 
-	lua_pushfstring(S, "%s.%s",
+	/* NOTE: this magic string representation of an
+	 * incoming signal must match the one in the Lua code */
+	lua_pushfstring(S, "%s\n%s\n%s",
+	                path      ? path      : "",
 	                interface ? interface : "",
 	                member    ? member    : "");
-	lua_rawget(S, -2);
-	if (lua_type(S, -1) != LUA_TFUNCTION) {
+
+	lua_rawget(S, LEM_DBUS_SIGNAL_TABLE);
+	/* several handlers of a signal are kept in a table whose
+	 * __call metamethod calls them in turn with the arguments
+	 * decoded here, once. Handlers with sender or argument rules
+	 * are wrapped in Match objects, which are checked before
+	 * anything is decoded, and Latest objects keep the signal
+	 * until their own thread asks for it */
+	switch (lua_type(S, -1)) {
+	case LUA_TFUNCTION:
+		break;
+
+	case LUA_TUSERDATA:
+		if (!signal_match(S, msg))
+			goto unhandled;
+		if (signal_latest(S, msg)) {
+			lua_settop(S, LEM_DBUS_TOP);
+			return DBUS_HANDLER_RESULT_HANDLED;
+		}
+		if (lua_type(S, -1) == LUA_TFUNCTION)
+			break;
+		goto unhandled;
+
+	case LUA_TTABLE:
+		if (signal_filter(S, msg))
+			break;
+		/* fall through */
+	default:
+	unhandled:
 		lua_settop(S, LEM_DBUS_TOP);
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
 	/* create new thread */
 	T = lem_newthread();
-	lua_pushvalue(S, LEM_DBUS_BUS_OBJECT);
-	lua_xmove(S, T, 2);
-	lua_settop(S, LEM_DBUS_TOP);
+	lua_xmove(S, T, 1);
 
-	/* push the send_reply function */
-	m = lua_newuserdata(T, sizeof(struct message_object));
-	m->msg = msg;
-	dbus_message_ref(msg);
+	lem_queue(T, lem_dbus_push_arguments(T, msg));
 
-	/* set metatable */
-	lua_pushvalue(S, LEM_DBUS_MESSAGE_META);
-	lua_xmove(S, T, 1);
-	lua_setmetatable(T, -2);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
 
-	lua_pushcclosure(T, message_reply, 2);
+struct message_object {
+	DBusMessage *msg;
+	struct bus_object *bus;
+	struct histogram *latency;
+	ev_tstamp start;
+	struct limit *limit[2]; /* method and object limit */
+};
 
-	lem_queue(T, lem_dbus_push_arguments(T, msg) + 1);
+/*
+ * Answer the method call msg with a LimitsExceeded error.
+ */
+static void
+call_shed(lua_State *T, struct bus_object *bus, DBusMessage *msg)
+{
+	DBusMessage *reply;
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	bus->stats.shed++;
+	if (bus->conn == NULL || dbus_message_get_no_reply(msg))
+		return;
+
+	reply = dbus_message_new_error(msg, DBUS_ERROR_LIMITS_EXCEEDED,
+	                               "Too many calls in progress");
+	if (reply == NULL)
+		return;
+
+	if (bus_send(bus, reply, bus_sendclass(T, bus,
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg))))
+		stats_error(T, bus, "sent", DBUS_ERROR_LIMITS_EXCEEDED);
+	dbus_message_unref(reply);
 }
 
-static DBusHandlerResult
-message_filter(DBusConnection *conn, DBusMessage *msg, void *data)
+static void limit_run(lua_State *T, struct message_object *m,
+                      int i, int nargs);
+
+/*
+ * Give back the slots the call m holds on its first n
+ * limits, handing each one to the next call waiting for it.
+ * Every slot is given back before any waiter is started, and
+ * waiters on the object limit go first, as they already hold
+ * their slot on the method limit.
+ */
+static void
+limit_release(struct message_object *m, int n)
 {
-	lua_State *S = data;
+	int i;
 
-	(void)conn;
+	for (i = 0; i < n; i++) {
+		if (m->limit[i])
+			m->limit[i]->active--;
+	}
 
-	switch (dbus_message_get_type(msg)) {
-	case DBUS_MESSAGE_TYPE_SIGNAL:
-		return signal_handler(S, msg);
-	case DBUS_MESSAGE_TYPE_METHOD_CALL:
-		return method_call_handler(S, msg);
+	for (i = n - 1; i >= 0; i--) {
+		struct limit *l = m->limit[i];
+		lua_State *W;
+		void *data;
+		int nargs;
+
+		if (l == NULL)
+			continue;
+
+		W = lem_dbus_limit_shift(l, &data, &nargs);
+		if (W)
+			limit_run(W, data, i, nargs);
+	}
+}
+
+/*
+ * Take a slot on the limits of the call m from i on and
+ * start handling it in T, or queue it on the first limit
+ * without a free slot. If there is no room for it in the
+ * queue the call is shed, which can only happen once it
+ * got past the method limit as the queues are checked
+ * before T is created.
+ */
+static void
+limit_run(lua_State *T, struct message_object *m, int i, int nargs)
+{
+	for (; i < 2; i++) {
+		struct limit *l = m->limit[i];
+
+		if (l == NULL)
+			continue;
+
+		if (l->active < l->max) {
+			l->active++;
+			continue;
+		}
+
+		if (lem_dbus_limit_push(l, dbus_message_get_sender(m->msg),
+		                        T, m, nargs))
+			return;
+
+		l->shed++;
+		m->bus->stats.handlers--;
+		call_shed(T, m->bus, m->msg);
+		dbus_message_unref(m->msg);
+		m->msg = NULL;
+		limit_release(m, i);
+		lem_forgetthread(T);
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (m->limit[i])
+			m->limit[i]->handled++;
+	}
+
+	lem_queue(T, nargs);
+}
+
+/*
+ * Return the limit a new call would have to wait
+ * for, or NULL if it can be handled right away.
+ */
+static struct limit *
+limit_blocking(struct limit *method, struct limit *object)
+{
+	if (method && method->active >= method->max)
+		return method;
+	if (object && object->active >= object->max)
+		return object;
+	return NULL;
+}
+
+static int
+message_gc(lua_State *T)
+{
+	struct message_object *m = lua_touserdata(T, 1);
+
+	if (m->msg) {
+		/* the handler never sent a reply */
+		m->bus->stats.handlers--;
+		limit_release(m, 2);
+		dbus_message_unref(m->msg);
+		m->msg = NULL;
+	}
+
+	return 0;
+}
+
+#define LEM_DBUS_REPLY_META "lem.dbus.Reply"
+
+/*
+ * Turn a copy of the method return encoded into
+ * a reply to the method call msg.
+ */
+static DBusMessage *
+encoded_copy(DBusMessage *msg, DBusMessage *encoded)
+{
+	DBusMessage *reply;
+
+	/* the encoded message carries the serial given by
+	 * marshal(), a copy has its serial reset so the connection
+	 * will assign a fresh one when sending it */
+	reply = dbus_message_copy(encoded);
+	if (reply == NULL)
+		return NULL;
+
+	dbus_message_set_no_reply(reply, TRUE);
+	if (!dbus_message_set_reply_serial(reply, dbus_message_get_serial(msg)) ||
+	    !dbus_message_set_destination(reply, dbus_message_get_sender(msg))) {
+		dbus_message_unref(reply);
+		return NULL;
+	}
+
+	return reply;
+}
+
+/*
+ * Turn a method return encoded by marshal() into
+ * a reply to the method call msg.
+ */
+static DBusMessage *
+encoded_reply(DBusMessage *msg, const char *data, size_t len)
+{
+	DBusMessage *encoded;
+	DBusMessage *reply;
+
+	encoded = dbus_message_demarshal(data, (int)len, NULL);
+	if (encoded == NULL)
+		return NULL;
+
+	if (dbus_message_get_type(encoded) != DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+		dbus_message_unref(encoded);
+		return NULL;
+	}
+
+	reply = encoded_copy(msg, encoded);
+	dbus_message_unref(encoded);
+	return reply;
+}
+
+static int
+message_reply(lua_State *T)
+{
+	struct bus_object *bus = lua_touserdata(T, lua_upvalueindex(1));
+	DBusConnection *conn = bus->conn;
+	struct message_object *m;
+	DBusMessage *msg;
+	DBusMessage *reply;
+	int class;
+
+	if (conn == NULL) /* connection closed */
+		return 0;
+
+	m = lua_touserdata(T, lua_upvalueindex(2));
+	msg = m->msg;
+	if (msg == NULL)
+		return luaL_error(T, "send reply called twice");
+
+	m->msg = NULL;
+	bus->stats.handlers--;
+	limit_release(m, 2);
+	class = bus_sendclass(T, bus, dbus_message_get_interface(msg),
+	                      dbus_message_get_member(msg));
+
+	/* check if the method returned an error */
+	if (lua_gettop(T) > 0 && lua_isnil(T, 1)) {
+		const char *name = luaL_checkstring(T, 2);
+		const char *message = luaL_optstring(T, 3, NULL);
+
+		if (message && message[0] == '\0')
+			message = NULL;
+
+		reply = dbus_message_new_error(msg, name, message);
+		dbus_message_unref(msg);
+		if (reply == NULL)
+			return 0;
+
+		stats_error(T, bus, "sent", name);
+	} else if (lua_type(T, 1) == LUA_TBOOLEAN && !lua_toboolean(T, 1)) {
+		/* reply encoded in advance by newreply() or marshal() */
+		if (lua_type(T, 2) == LUA_TUSERDATA) {
+			DBusMessage **encoded = luaL_checkudata(T, 2,
+					LEM_DBUS_REPLY_META);
+
+			reply = encoded_copy(msg, *encoded);
+		} else {
+			size_t len;
+			const char *data = luaL_checklstring(T, 2, &len);
+
+			reply = encoded_reply(msg, data, len);
+		}
+		dbus_message_unref(msg);
+		if (reply == NULL)
+			return luaL_error(T, "invalid encoded reply");
+	} else {
+		const char *signature = luaL_optstring(T, 1, NULL);
+
+		reply = dbus_message_new_method_return(msg);
+		dbus_message_unref(msg);
+		if (reply == NULL)
+			return 0;
+
+		if (signature && signature[0] != '\0' &&
+		    lem_dbus_add_arguments(T, 2, signature, reply)) {
+			dbus_message_unref(reply);
+			/* add_arguments() pushes its own error message */
+			return luaL_error(T, "%s", lua_tostring(T, -1));
+		}
+
+		if (fds_unsupported(conn, reply)) {
+			dbus_message_unref(reply);
+			return luaL_error(T, "file descriptor passing not supported");
+		}
+	}
+
+	(void)bus_send(bus, reply, class);
+	lem_dbus_hist_record(m->latency, ev_time() - m->start);
+	dbus_message_unref(reply);
+	return 0;
+}
+
+/*
+ * Hand the method call to the raw handler on top of the stack
+ * as a Message object, without decoding its arguments.
+ */
+static DBusHandlerResult
+raw_call_handler(lua_State *S, DBusMessage *msg)
+{
+	struct bus_object *bus = lua_touserdata(S, LEM_DBUS_BUS_OBJECT);
+	lua_State *T;
+
+	T = lem_newthread();
+	lua_xmove(S, T, 1);
+	lua_settop(S, LEM_DBUS_TOP);
+
+	lem_dbus_message_push(T, msg, bus->conn);
+	lem_queue(T, 1);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+method_call_handler(lua_State *S, DBusMessage *msg)
+{
+	lua_State *T;
+	struct bus_object *bus;
+	struct message_object *m;
+	struct limit *ml;
+	struct limit *ol;
+	struct limit *blocking;
+	const char *path = dbus_message_get_path(msg);
+	const char *interface = dbus_message_get_interface(msg);
+	const char *member = dbus_message_get_member(msg);
+
+	lem_debug("received call\n  %s\n  %s\n  %s(%s)",
+	          path, interface, member,
+		  dbus_message_get_signature(msg));
+
+	lua_pushstring(S, path ? path : "");
+	lua_rawget(S, LEM_DBUS_OBJECT_TABLE);
+	if (lua_isnil(S, -1)) {
+		/* fall back to the raw handler for all paths */
+		lua_pop(S, 1);
+		lua_pushliteral(S, "*");
+		lua_rawget(S, LEM_DBUS_OBJECT_TABLE);
+	}
+	if (lua_type(S, -1) == LUA_TFUNCTION)
+		return raw_call_handler(S, msg);
+	if (lua_type(S, -1) != LUA_TTABLE) {
+		lua_settop(S, LEM_DBUS_TOP);
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	lua_pushfstring(S, "%s.%s",
+	                interface ? interface : "",
+	                member    ? member    : "");
+	lua_pushvalue(S, -1);
+	lua_rawget(S, -3);
+	if (lua_type(S, -1) != LUA_TFUNCTION) {
+		lua_settop(S, LEM_DBUS_TOP);
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	/* look up the limits set with Object:setlimit(),
+	 * method limits are kept in a table at index 2
+	 * and the limit of the whole object at index 1 */
+	lua_rawgeti(S, -3, 2);
+	if (lua_type(S, -1) == LUA_TTABLE) {
+		lua_pushvalue(S, -3);
+		lua_rawget(S, -2);
+		lua_replace(S, -2);
+	}
+	lua_rawgeti(S, -4, 1);
+	ml = lem_dbus_limit_get(S, -2);
+	ol = lem_dbus_limit_get(S, -1);
+
+	bus = lua_touserdata(S, LEM_DBUS_BUS_OBJECT);
+
+	/* shed the call before spending anything on it
+	 * if it has nowhere to wait for a free slot */
+	blocking = limit_blocking(ml, ol);
+	if (blocking &&
+	    lem_dbus_limit_full(blocking, dbus_message_get_sender(msg))) {
+		blocking->shed++;
+		call_shed(S, bus, msg);
+		lua_settop(S, LEM_DBUS_TOP);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	/* create new thread */
+	T = lem_newthread();
+	lua_pushvalue(S, -3);
+	lua_pushvalue(S, LEM_DBUS_BUS_OBJECT);
+	lua_xmove(S, T, 2);
+
+	/* push the send_reply function */
+	m = lua_newuserdata(T, sizeof(struct message_object));
+	m->msg = msg;
+	m->bus = bus;
+	m->latency = lem_dbus_hist_get(&bus->handler_latency,
+	                               path, interface, member);
+	m->start = ev_time();
+	m->limit[0] = ml;
+	m->limit[1] = ol;
+	dbus_message_ref(msg);
+
+	/* set metatable */
+	lua_pushvalue(S, LEM_DBUS_MESSAGE_META);
+	lua_xmove(S, T, 1);
+	lua_setmetatable(T, -2);
+
+	/* the limits are kept alive as upvalues */
+	lua_xmove(S, T, 2);
+	lua_settop(S, LEM_DBUS_TOP);
+	lua_pushcclosure(T, message_reply, 4);
+
+	bus->stats.handlers++;
+
+	limit_run(T, m, 0, lem_dbus_push_arguments(T, msg) + 1);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+message_filter(DBusConnection *conn, DBusMessage *msg, void *data)
+{
+	lua_State *S = data;
+	struct bus_object *bus = lua_touserdata(S, LEM_DBUS_BUS_OBJECT);
+	int type = dbus_message_get_type(msg);
+
+	(void)conn;
+
+	bus->stats.received[type]++;
+	bus_capture_message(bus, msg, 0);
+
+	switch (type) {
+	case DBUS_MESSAGE_TYPE_SIGNAL:
+		return signal_handler(S, msg);
+	case DBUS_MESSAGE_TYPE_METHOD_CALL:
+		return method_call_handler(S, msg);
+	}
+
+	lem_debug("Hmm.. received %s message",
+	          dbus_message_type_to_string(dbus_message_get_type(msg)));
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusHandlerResult
+monitor_filter(DBusConnection *conn, DBusMessage *msg, void *data)
+{
+	struct bus_object *bus = data;
+	struct monitor *mon = bus->monitor;
+	int type = dbus_message_get_type(msg);
+	const char *s;
+
+	(void)conn;
+
+	/* leave the local Disconnected signal to libdbus */
+	if (dbus_message_has_path(msg, DBUS_PATH_LOCAL))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	bus->stats.received[type]++;
+	bus_capture_message(bus, msg, 0);
+
+	/* everything else is handled here, a monitor must
+	 * never send, not even error replies to method calls */
+	if (!(mon->types & (1U << type)))
+		return DBUS_HANDLER_RESULT_HANDLED;
+
+	if (mon->sender && ((s = dbus_message_get_sender(msg)) == NULL ||
+	                    strcmp(s, mon->sender) != 0))
+		return DBUS_HANDLER_RESULT_HANDLED;
+
+	if (mon->interface && ((s = dbus_message_get_interface(msg)) == NULL ||
+	                       strcmp(s, mon->interface) != 0))
+		return DBUS_HANDLER_RESULT_HANDLED;
+
+	if (mon->T) {
+		lua_State *T = mon->T;
+
+		mon->T = NULL;
+		lem_dbus_message_push(T, msg, NULL);
+		lem_queue(T, 1);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (mon->count == mon->size) {
+		bus->stats.dropped++;
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	mon->queue[(mon->head + mon->count) % mon->size] = dbus_message_ref(msg);
+	mon->count++;
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/*
+ * Remove the monitor filter and free the queue, a thread
+ * waiting for messages is woken up with nil, reason.
+ */
+static void
+monitor_stop(struct bus_object *bus, const char *reason)
+{
+	struct monitor *mon = bus->monitor;
+
+	if (mon == NULL)
+		return;
+
+	if (bus->conn)
+		dbus_connection_remove_filter(bus->conn, monitor_filter, bus);
+
+	while (mon->count > 0) {
+		dbus_message_unref(mon->queue[mon->head]);
+		mon->head = (mon->head + 1) % mon->size;
+		mon->count--;
+	}
+
+	if (mon->T) {
+		lua_settop(mon->T, 0);
+		lua_pushnil(mon->T);
+		lua_pushstring(mon->T, reason);
+		lem_queue(mon->T, 2);
+	}
+
+	free(mon->sender);
+	free(mon->interface);
+	free(mon->queue);
+	free(mon);
+	bus->monitor = NULL;
+}
+
+/*
+ * Bus:setmonitor()
+ *
+ * argument 1: bus object
+ * argument 2: list of message types to keep (optional)
+ * argument 3: sender to keep messages from (optional)
+ * argument 4: interface to keep messages for (optional)
+ * argument 5: queue size (optional)
+ *
+ * Installs the filter for monitoring. Use Bus:monitor() which
+ * also asks the bus daemon to make this connection a monitor.
+ */
+static int
+bus_setmonitor(lua_State *T)
+{
+	struct bus_object *bus;
+	struct monitor *mon;
+	unsigned int types = 0;
+	const char *sender;
+	const char *interface;
+	lua_Number size;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	sender = luaL_optstring(T, 3, NULL);
+	interface = luaL_optstring(T, 4, NULL);
+	size = luaL_optnumber(T, 5, 4096);
+	luaL_argcheck(T, size >= 1, 5, "queue size must be positive");
+
+	if (lua_isnoneornil(T, 2))
+		types = ~0U;
+	else {
+		int i;
+
+		luaL_checktype(T, 2, LUA_TTABLE);
+		for (i = 1; ; i++) {
+			int type;
+
+			lua_rawgeti(T, 2, i);
+			if (lua_isnil(T, -1))
+				break;
+			type = dbus_message_type_from_string(luaL_checkstring(T, -1));
+			if (type == DBUS_MESSAGE_TYPE_INVALID)
+				return luaL_argerror(T, 2, "unknown message type");
+			types |= 1U << type;
+			lua_pop(T, 1);
+		}
+	}
+
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	if (bus->monitor) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "already monitoring");
+		return 2;
+	}
+
+	mon = lem_xmalloc(sizeof(struct monitor));
+	mon->size = (unsigned int)size;
+	mon->queue = lem_xmalloc(mon->size * sizeof(DBusMessage *));
+	mon->head = 0;
+	mon->count = 0;
+	mon->types = types;
+	mon->sender = sender ? strdup(sender) : NULL;
+	mon->interface = interface ? strdup(interface) : NULL;
+	mon->T = NULL;
+
+	if (!dbus_connection_add_filter(bus->conn, monitor_filter, bus, NULL)) {
+		free(mon->sender);
+		free(mon->interface);
+		free(mon->queue);
+		free(mon);
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+	bus->monitor = mon;
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:stopmonitor()
+ *
+ * argument 1: bus object
+ *
+ * Removes the monitor filter again. The bus daemon
+ * won't let a monitor do anything else though,
+ * so the connection should be closed afterwards.
+ */
+static int
+bus_stopmonitor(lua_State *T)
+{
+	struct bus_object *bus;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	if (bus->monitor == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not monitoring");
+		return 2;
+	}
+
+	monitor_stop(bus, "interrupted");
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:nextmessage()
+ *
+ * argument 1: bus object
+ *
+ * Returns the next monitored message as a Message object,
+ * waiting for one if none are queued.
+ */
+static int
+bus_nextmessage(lua_State *T)
+{
+	struct bus_object *bus;
+	struct monitor *mon;
+	DBusMessage *msg;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	mon = bus->monitor;
+	if (mon == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not monitoring");
+		return 2;
+	}
+
+	if (mon->T) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	if (mon->count == 0) {
+		mon->T = T;
+		lua_settop(T, 0);
+		return lua_yield(T, 0);
+	}
+
+	msg = mon->queue[mon->head];
+	mon->head = (mon->head + 1) % mon->size;
+	mon->count--;
+	lem_dbus_message_push(T, msg, NULL);
+	dbus_message_unref(msg);
+	return 1;
+}
+
+/*
+ * DBus.listen()
+ *
+ * argument 1: bus object
+ */
+static int
+bus_listen(lua_State *T)
+{
+	DBusConnection *conn;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	conn = bus_unbox(T, 1);
+	if (conn == NULL)
+		return bus_closed(T);
+
+	lua_settop(T, 1);
+	lua_getuservalue(T, 1);
+	lua_rawgeti(T, 2, 3);
+	if (lua_isthread(T, -1)) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+	lua_pop(T, 1);
+
+	/* set the message filter */
+	if (!dbus_connection_add_filter(conn, message_filter, T, NULL)) {
+		dbus_connection_close(conn);
+		dbus_connection_unref(conn);
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	lua_pushthread(T);
+	lua_rawseti(T, 2, 3);
+
+	/* push signal table */
+	lua_rawgeti(T, 2, 1);
+	/* push object table */
+	lua_rawgeti(T, 2, 2);
+	/* push message metatable */
+	lua_pushvalue(T, lua_upvalueindex(1));
+	lua_replace(T, LEM_DBUS_MESSAGE_META);
+
+	return lua_yield(T, LEM_DBUS_TOP);
+}
+
+/*
+ * DBus.interrupt()
+ *
+ * argument 1: bus object
+ */
+static int
+bus_interrupt(lua_State *T)
+{
+	DBusConnection *conn;
+	lua_State *S;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	conn = bus_unbox(T, 1);
+	if (conn == NULL)
+		return bus_closed(T);
+
+	lua_settop(T, 1);
+	lua_getuservalue(T, 1);
+	lua_rawgeti(T, 2, 3);
+	if (!lua_isthread(T, -1)) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not busy");
+		return 2;
+	}
+	S = lua_tothread(T, -1);
+	lua_pop(T, 1);
+	lua_pushnil(T);
+	lua_rawseti(T, -2, 3);
+
+	lua_settop(S, 0);
+	lua_pushnil(S);
+	lua_pushliteral(S, "interrupted");
+	lem_queue(S, 2);
+
+	dbus_connection_remove_filter(conn, message_filter, S);
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:waitdisconnect()
+ *
+ * argument 1: bus object
+ *
+ * Waits until the connection is lost and returns true,
+ * right away if it already is.
+ */
+static int
+bus_waitdisconnect(lua_State *T)
+{
+	struct bus_object *bus;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	if (bus->disconnected) {
+		lua_pushboolean(T, 1);
+		return 1;
+	}
+
+	if (bus->disconnect_T) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	bus->disconnect_T = T;
+	return lua_yield(T, 0);
+}
+
+/*
+ * DBus.__gc()
+ *
+ * argument 1: bus object
+ */
+static int
+bus_gc(lua_State *T)
+{
+	struct bus_object *obj = lua_touserdata(T, 1);
+
+	lem_debug("collecting DBus connection");
+
+	monitor_stop(obj, "closed");
+	if (obj->conn) {
+		forward_cancel(obj, "closed");
+		(void)dbus_connection_set_data(obj->conn, bus_slot, NULL, NULL);
+		dbus_connection_close(obj->conn);
+		dbus_connection_unref(obj->conn);
+		obj->conn = NULL;
+	}
+
+	bus_capture_stop(obj);
+	luaL_unref(T, LUA_REGISTRYINDEX, obj->errors);
+	obj->errors = LUA_NOREF;
+	luaL_unref(T, LUA_REGISTRYINDEX, obj->inflight);
+	obj->inflight = LUA_NOREF;
+	luaL_unref(T, LUA_REGISTRYINDEX, obj->classes);
+	obj->classes = LUA_NOREF;
+	sendq_clear(obj);
+	ev_prepare_stop(LEM_ &obj->prepare);
+	calls_detach(obj);
+	lem_dbus_hist_free(&obj->call_latency);
+	lem_dbus_hist_free(&obj->handler_latency);
+
+	return 0;
+}
+
+/*
+ * Bus:capture()
+ *
+ * argument 1: bus object
+ * argument 2: filename (optional)
+ *
+ * Starts writing every message sent on the bus, and every
+ * message received while listening or as a reply to a call,
+ * to a new capture file. Without a filename it stops
+ * an ongoing capture.
+ */
+static int
+bus_capture(lua_State *T)
+{
+	struct bus_object *bus;
+	const char *filename;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	filename = luaL_optstring(T, 2, NULL);
+
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	bus_capture_stop(bus);
+
+	if (filename) {
+		bus->capture = lem_dbus_capture_create(filename);
+		if (bus->capture == NULL) {
+			lua_pushnil(T);
+			lua_pushfstring(T, "error creating %s: %s",
+					filename, strerror(errno));
+			return 2;
+		}
+	}
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:sendraw()
+ *
+ * argument 1: bus object
+ * argument 2: message in wire format
+ * argument 3: destination (optional)
+ *
+ * Sends a message as returned by Capture:read() or marshal(),
+ * optionally to a new destination. Replies to method calls
+ * are not waited for.
+ */
+static int
+bus_sendraw(lua_State *T)
+{
+	struct bus_object *bus;
+	size_t len;
+	const char *data;
+	const char *destination;
+	DBusMessage *encoded;
+	DBusMessage *msg;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	data = luaL_checklstring(T, 2, &len);
+	destination = luaL_optstring(T, 3, NULL);
+
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	encoded = dbus_message_demarshal(data, (int)len, NULL);
+	if (encoded == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "invalid message");
+		return 2;
+	}
+
+	/* reset the serial so the connection assigns a new one */
+	msg = dbus_message_copy(encoded);
+	dbus_message_unref(encoded);
+	if (msg == NULL)
+		goto oom;
+
+	if (destination && !dbus_message_set_destination(msg, destination))
+		goto oom;
+
+	if (dbus_message_contains_unix_fds(msg)) {
+		dbus_message_unref(msg);
+		lua_pushnil(T);
+		lua_pushliteral(T, "cannot send captured file descriptors");
+		return 2;
+	}
+
+	if (!bus_send(bus, msg, bus_sendclass(T, bus,
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg))))
+		goto oom;
+
+	dbus_message_unref(msg);
+	lua_pushboolean(T, 1);
+	return 1;
+
+oom:
+	if (msg)
+		dbus_message_unref(msg);
+	lua_pushnil(T);
+	lua_pushliteral(T, "out of memory");
+	return 2;
+}
+
+/*
+ * A method call forwarded with Bus:forward() waiting
+ * for the reply to send back to the original caller.
+ */
+struct forward {
+	struct call_link link;
+	DBusConnection *via;  /* connection the call was forwarded on */
+	DBusConnection *conn; /* connection the call came from */
+	DBusMessage *msg;     /* the original call */
+	int class;            /* send class of the reply */
+};
+
+static void
+forward_free(void *data)
+{
+	struct forward *f = data;
+
+	dbus_connection_unref(f->via);
+	dbus_connection_unref(f->conn);
+	dbus_message_unref(f->msg);
+	free(f);
+}
+
+/*
+ * Answer the original caller of the forwarded call l
+ * with a NoReply error carrying message.
+ */
+static void
+forward_fail(struct call_link *l, const char *message)
+{
+	struct forward *f = (struct forward *)l;
+	struct bus_object *from = bus_fromconn(f->conn);
+	DBusMessage *reply;
+
+	if (from == NULL || dbus_message_get_no_reply(f->msg))
+		return;
+
+	reply = dbus_message_new_error(f->msg, DBUS_ERROR_NO_REPLY, message);
+	if (reply) {
+		(void)bus_send(from, reply, f->class);
+		dbus_message_unref(reply);
+	}
+}
+
+/*
+ * Give up on the calls forwarded on bus before its
+ * connection goes away, so the original callers
+ * don't wait for replies that never come.
+ */
+static void
+forward_cancel(struct bus_object *bus, const char *message)
+{
+	struct call_link *l;
+	struct call_link *next;
+
+	for (l = bus->calls; l; l = next) {
+		DBusPendingCall *pending = l->pending;
+
+		next = l->next;
+		if (l->kind != CALL_FORWARD)
+			continue;
+
+		calls_remove(l);
+		dbus_pending_call_cancel(pending);
+		forward_fail(l, message);
+		dbus_pending_call_unref(pending);
+		bus->stats.pending--;
+	}
+}
+
+static void
+forward_cb(DBusPendingCall *pending, void *data)
+{
+	struct forward *f = data;
+	/* the bus the call was forwarded on may be gone by now */
+	struct bus_object *bus = bus_fromconn(f->via);
+	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
+	DBusMessage *reply;
+
+	calls_remove(&f->link);
+	dbus_pending_call_unref(pending);
+
+	if (bus)
+		bus->stats.pending--;
+	if (msg == NULL)
+		return;
+
+	if (bus) {
+		bus->stats.received[dbus_message_get_type(msg)]++;
+		bus_capture_message(bus, msg, 0);
+	}
+
+	/* readdress a copy of the reply to the original caller */
+	if (fds_unsupported(f->conn, msg))
+		reply = dbus_message_new_error(f->msg, DBUS_ERROR_FAILED,
+				"file descriptor passing not supported");
+	else {
+		reply = dbus_message_copy(msg);
+		if (reply && !(dbus_message_set_sender(reply, NULL) &&
+		               dbus_message_set_reply_serial(reply,
+		                       dbus_message_get_serial(f->msg)) &&
+		               dbus_message_set_destination(reply,
+		                       dbus_message_get_sender(f->msg)))) {
+			dbus_message_unref(reply);
+			reply = NULL;
+		}
+	}
+	dbus_message_unref(msg);
+
+	if (reply) {
+		/* the bus the call came from may be gone by now */
+		struct bus_object *from = bus_fromconn(f->conn);
+
+		if (from)
+			(void)bus_send(from, reply, f->class);
+		dbus_message_unref(reply);
+	}
+}
+
+/*
+ * Send the method call msg forwarded from orig on bus, the reply
+ * goes back through the bus of the connection from. Returns an
+ * error message on failure.
+ */
+static const char *
+forward_send(lua_State *T, struct bus_object *bus, DBusMessage *msg,
+             DBusMessage *orig, DBusConnection *from)
+{
+	struct bus_object *origin = bus_fromconn(from);
+	DBusPendingCall *pending;
+	struct forward *f;
+
+	if (!dbus_connection_send_with_reply(bus->conn, msg, &pending, -1))
+		return "out of memory";
+	if (pending == NULL)
+		return "closed";
+
+	f = lem_xmalloc(sizeof(struct forward) + calls_destlen(msg));
+	f->via = dbus_connection_ref(bus->conn);
+	f->conn = dbus_connection_ref(from);
+	f->msg = dbus_message_ref(orig);
+	f->class = origin ? bus_sendclass(T, origin,
+			dbus_message_get_interface(orig),
+			dbus_message_get_member(orig)) : -1;
+	if (!dbus_pending_call_set_notify(pending, forward_cb, f,
+	                                  forward_free)) {
+		forward_free(f);
+		dbus_pending_call_cancel(pending);
+		dbus_pending_call_unref(pending);
+		return "out of memory";
+	}
+
+	f->link.kind = CALL_FORWARD;
+	calls_insert(bus, &f->link, pending, msg, (char *)(f + 1));
+	bus->stats.pending++;
+	bus->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
+	bus_capture_message(bus, msg, 1);
+	return NULL;
+}
+
+/*
+ * Bus:forward()
+ *
+ * argument 1: bus object
+ * argument 2: Message object
+ * argument 3: destination (optional)
+ * argument 4: path (optional)
+ *
+ * Sends a copy of a message received by a raw handler on this bus,
+ * without decoding it, optionally to a new destination and path.
+ * If it is a method call the reply, or error, is sent back to the
+ * original caller on the connection the message came from.
+ */
+static int
+bus_forward(lua_State *T)
+{
+	struct bus_object *bus;
+	DBusMessage *orig;
+	DBusConnection *from;
+	const char *destination;
+	const char *path;
+	DBusMessage *msg;
+	const char *err;
+	int type;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	orig = lem_dbus_message_get(T, 2);
+	from = lem_dbus_message_conn(T, 2);
+	destination = luaL_optstring(T, 3, NULL);
+	path = luaL_optstring(T, 4, NULL);
+
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
+		return bus_closed(T);
+
+	/* the copy has its serial reset so the connection
+	 * assigns a fresh one, the sender is filled in by
+	 * the bus daemon */
+	msg = dbus_message_copy(orig);
+	if (msg == NULL ||
+	    !dbus_message_set_sender(msg, NULL) ||
+	    (destination && !dbus_message_set_destination(msg, destination)) ||
+	    (path && !dbus_message_set_path(msg, path)))
+		goto oom;
+
+	if (fds_unsupported(bus->conn, msg)) {
+		dbus_message_unref(msg);
+		return bus_nofds(T);
+	}
+
+	type = dbus_message_get_type(msg);
+	if (type == DBUS_MESSAGE_TYPE_METHOD_CALL && from &&
+	    !dbus_message_get_no_reply(msg)) {
+		if (bus->hello)
+			return bus_hold(T, bus, msg, orig, from);
+
+		err = forward_send(T, bus, msg, orig, from);
+		if (err) {
+			dbus_message_unref(msg);
+			lua_pushnil(T);
+			lua_pushstring(T, err);
+			return 2;
+		}
+	} else if (!bus_send(bus, msg, -1))
+		goto oom;
+
+	dbus_message_unref(msg);
+	lua_pushboolean(T, 1);
+	return 1;
+
+oom:
+	if (msg)
+		dbus_message_unref(msg);
+	lua_pushnil(T);
+	lua_pushliteral(T, "out of memory");
+	return 2;
+}
+
+/*
+ * Message:error()
+ *
+ * argument 1: message object
+ * argument 2: error name
+ * argument 3: error message (optional)
+ *
+ * Answers a method call received by a raw handler
+ * with an error.
+ */
+static int
+message_error(lua_State *T)
+{
+	DBusMessage *msg = lem_dbus_message_get(T, 1);
+	DBusConnection *conn = lem_dbus_message_conn(T, 1);
+	const char *name = luaL_checkstring(T, 2);
+	const char *message = luaL_optstring(T, 3, NULL);
+	struct bus_object *bus;
+	DBusMessage *reply;
+
+	if (conn == NULL ||
+	    dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not a received method call");
+		return 2;
+	}
+
+	if (dbus_message_get_no_reply(msg)) {
+		lua_pushboolean(T, 1);
+		return 1;
+	}
+
+	bus = bus_fromconn(conn);
+	if (bus == NULL)
+		return bus_closed(T);
+
+	reply = dbus_message_new_error(msg, name, message);
+	if (reply == NULL || !bus_send(bus, reply, bus_sendclass(T, bus,
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg)))) {
+		if (reply)
+			dbus_message_unref(reply);
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	stats_error(T, bus, "sent", name);
+	dbus_message_unref(reply);
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:resetstats()
+ *
+ * argument 1: bus object
+ *
+ * Zeroes all counters, gauges are left alone.
+ */
+static int
+bus_resetstats(lua_State *T)
+{
+	struct bus_object *obj;
+	struct bus_stats *st;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	obj = lua_touserdata(T, 1);
+	if (obj->conn == NULL)
+		return bus_closed(T);
+	st = &obj->stats;
+
+	memset(st->sent, 0, sizeof(st->sent));
+	memset(st->received, 0, sizeof(st->received));
+	st->dispatches = 0;
+	st->dropped = 0;
+	st->coalesced = 0;
+	st->shed = 0;
+	st->failed = 0;
+	st->offloaded = 0;
+	st->dispatch_time = 0;
+
+	lua_rawgeti(T, LUA_REGISTRYINDEX, obj->errors);
+	lua_newtable(T);
+	lua_setfield(T, -2, "received");
+	lua_newtable(T);
+	lua_setfield(T, -2, "sent");
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Bus:latency()
+ *
+ * argument 1: bus object
+ * argument 2: 'call' or 'handler'
+ * ...         percentiles (optional)
+ *
+ * Returns a table with latency statistics in seconds. For 'call'
+ * the keys are "destination\ninterface\nmember" of outgoing calls
+ * and measure the time until the reply resumes the caller, for
+ * 'handler' they are "path\ninterface\nmember" of incoming calls and
+ * measure the time until the reply is sent. Each value is a table
+ * with count, min, max, mean and the requested percentiles, which
+ * default to 50, 90, 99 and 99.9.
+ */
+static int
+bus_latency(lua_State *T)
+{
+	static const char *const kinds[] = { "call", "handler", NULL };
+	struct bus_object *obj;
+	int kind;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	kind = luaL_checkoption(T, 2, NULL, kinds);
+	obj = lua_touserdata(T, 1);
+	if (obj->conn == NULL)
+		return bus_closed(T);
+
+	if (lua_gettop(T) == 2) {
+		lua_pushnumber(T, 50);
+		lua_pushnumber(T, 90);
+		lua_pushnumber(T, 99);
+		lua_pushnumber(T, 99.9);
+	}
+
+	lem_dbus_hist_push(T, kind ? &obj->handler_latency : &obj->call_latency, 3);
+	return 1;
+}
+
+/*
+ * Bus:resetlatency()
+ *
+ * argument 1: bus object
+ */
+static int
+bus_resetlatency(lua_State *T)
+{
+	struct bus_object *obj;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	obj = lua_touserdata(T, 1);
+	if (obj->conn == NULL)
+		return bus_closed(T);
+
+	lem_dbus_hist_reset(&obj->call_latency);
+	lem_dbus_hist_reset(&obj->handler_latency);
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static void
+stats_set(lua_State *T, int since, const char *name, lua_Number value)
+{
+	if (since) {
+		lua_getfield(T, since, name);
+		value -= lua_tonumber(T, -1);
+		lua_pop(T, 1);
+	}
+	lua_pushnumber(T, value);
+	lua_setfield(T, -2, name);
+}
+
+/*
+ * Set field name of the table on top of the stack to a copy of
+ * the error counters in the table name of the table at index
+ * counters, minus those of the table at index since if non-zero.
+ */
+static void
+stats_errors(lua_State *T, int counters, int since, const char *name)
+{
+	int top = lua_gettop(T);
+	int result;
+
+	lua_getfield(T, counters, name);
+	if (since) {
+		lua_getfield(T, since, name);
+		since = lua_istable(T, -1) ? top + 2 : 0;
+	}
+
+	lua_newtable(T);
+	result = lua_gettop(T);
+	lua_pushnil(T);
+	while (lua_next(T, top + 1)) {
+		lua_Number value = lua_tonumber(T, -1);
+
+		lua_pop(T, 1);
+		if (since) {
+			lua_pushvalue(T, -1);
+			lua_rawget(T, since);
+			value -= lua_tonumber(T, -1);
+			lua_pop(T, 1);
+		}
+		lua_pushvalue(T, -1);
+		lua_pushnumber(T, value);
+		lua_rawset(T, result);
+	}
+
+	lua_setfield(T, top, name);
+	lua_settop(T, top);
+}
+
+static void
+stats_push_types(lua_State *T, unsigned long *counters, int since)
+{
+	int type;
+
+	lua_createtable(T, 0, DBUS_NUM_MESSAGE_TYPES - 1);
+	for (type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+	     type < DBUS_NUM_MESSAGE_TYPES; type++)
+		stats_set(T, since, dbus_message_type_to_string(type),
+		          (lua_Number)counters[type]);
+}
+
+/*
+ * Get the subtable name of the table at index since,
+ * returns its index or 0 if there is none.
+ */
+static int
+stats_since(lua_State *T, int since, const char *name)
+{
+	if (since == 0)
+		return 0;
+
+	lua_getfield(T, since, name);
+	if (lua_istable(T, -1))
+		return lua_gettop(T);
+
+	lua_pop(T, 1);
+	return 0;
+}
+
+/*
+ * Bus:stats()
+ *
+ * argument 1: bus object
+ * argument 2: earlier snapshot (optional)
+ *
+ * Returns a snapshot of the connection statistics. If an earlier
+ * snapshot is given the counters are relative to that, while
+ * gauges like pending and outgoing are always current values.
+ */
+static int
+bus_stats(lua_State *T)
+{
+	struct bus_object *obj;
+	struct bus_stats *st;
+	int since = 0;
+	int sub;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	obj = lua_touserdata(T, 1);
+	if (obj->conn == NULL)
+		return bus_closed(T);
+	st = &obj->stats;
+
+	if (!lua_isnoneornil(T, 2)) {
+		luaL_checktype(T, 2, LUA_TTABLE);
+		since = 2;
+	}
+	lua_settop(T, 2);
+
+	lua_createtable(T, 0, 9);
+
+	sub = stats_since(T, since, "sent");
+	stats_push_types(T, st->sent, sub);
+	lua_setfield(T, 3, "sent");
+	lua_settop(T, 3);
+
+	sub = stats_since(T, since, "received");
+	stats_push_types(T, st->received, sub);
+	lua_setfield(T, 3, "received");
+	lua_settop(T, 3);
+
+	lua_rawgeti(T, LUA_REGISTRYINDEX, obj->errors);
+	sub = stats_since(T, since, "errors");
+	lua_createtable(T, 0, 2);
+	stats_errors(T, 4, sub, "received");
+	stats_errors(T, 4, sub, "sent");
+	lua_setfield(T, 3, "errors");
+	lua_settop(T, 3);
+
+	stats_set(T, since, "dispatches", (lua_Number)st->dispatches);
+	stats_set(T, since, "dropped", (lua_Number)st->dropped);
+	stats_set(T, since, "coalesced", (lua_Number)st->coalesced);
+	stats_set(T, since, "shed", (lua_Number)st->shed);
+	stats_set(T, since, "failed", (lua_Number)st->failed);
+	stats_set(T, since, "offloaded", (lua_Number)st->offloaded);
+	stats_set(T, since, "dispatchtime", (lua_Number)st->dispatch_time);
+
+	lua_pushnumber(T, (lua_Number)st->pending);
+	lua_setfield(T, -2, "pending");
+	lua_pushnumber(T, (lua_Number)st->handlers);
+	lua_setfield(T, -2, "handlers");
+	lua_pushnumber(T, (lua_Number)dbus_connection_get_outgoing_size(obj->conn));
+	lua_setfield(T, -2, "outgoing");
+	lua_pushnumber(T, (lua_Number)dbus_connection_get_outgoing_unix_fds(obj->conn));
+	lua_setfield(T, -2, "outgoingfds");
+	lua_pushnumber(T, (lua_Number)sendq_count(obj));
+	lua_setfield(T, -2, "queued");
+
+	return 1;
+}
+
+/*
+ * Bus:close()
+ *
+ * argument 1: bus object
+ */
+static int
+bus_close(lua_State *T)
+{
+	struct bus_object *obj;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	obj = lua_touserdata(T, 1);
+	if (obj->conn == NULL)
+		return bus_closed(T);
+
+	lem_debug("closing DBus connection");
+
+	monitor_stop(obj, "closed");
+	forward_cancel(obj, "closed");
+	(void)dbus_connection_set_data(obj->conn, bus_slot, NULL, NULL);
+	dbus_connection_close(obj->conn);
+	dbus_connection_unref(obj->conn);
+	obj->conn = NULL;
+	if (obj->disconnect_T) {
+		lua_State *S = obj->disconnect_T;
+
+		obj->disconnect_T = NULL;
+		lua_settop(S, 0);
+		lua_pushnil(S);
+		lua_pushliteral(S, "closed");
+		lem_queue(S, 2);
+	}
+	bus_capture_stop(obj);
+	sendq_clear(obj);
+	ev_prepare_stop(LEM_ &obj->prepare);
+	calls_detach(obj);
+	if (obj->hello)
+		hello_release(obj, "closed");
+
+	lua_getuservalue(T, 1);
+	lua_rawgeti(T, -1, 3);
+	if (lua_isthread(T, -1)) {
+		lua_State *S = lua_tothread(T, -1);
+
+		lua_settop(S, 0);
+		lua_pushnil(S);
+		lua_pushliteral(S, "interrupted");
+		lem_queue(S, 2);
+	}
+
+	lua_pushnil(T);
+	lua_setuservalue(T, 1);
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Notice when the connection is lost, libdbus tells
+ * us by dispatching a signal on the Local interface.
+ */
+static DBusHandlerResult
+disconnect_filter(DBusConnection *conn, DBusMessage *msg, void *data)
+{
+	struct bus_object *bus = data;
+	lua_State *T = bus->disconnect_T;
+
+	(void)conn;
+
+	if (!dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected"))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	lem_debug("DBus connection lost");
+	bus->disconnected = 1;
+	if (T) {
+		bus->disconnect_T = NULL;
+		lua_settop(T, 0);
+		lua_pushboolean(T, 1);
+		lem_queue(T, 1);
+	}
+
+	/* let the listener see it too */
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/*
+ * Hook the connection conn into the event loop for the bus
+ * object obj. Returns an error message on failure.
+ */
+static const char *
+bus_setconn(struct bus_object *obj, DBusConnection *conn)
+{
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+	/* set watch functions */
+	if (!dbus_connection_set_watch_functions(conn,
+	                                         watch_add,
+	                                         watch_remove,
+	                                         watch_toggle,
+	                                         obj, NULL))
+		return "error setting watch functions";
+
+	/* set timout functions */
+	if (!dbus_connection_set_timeout_functions(conn,
+	                                           timeout_add,
+	                                           timeout_remove,
+	                                           timeout_toggle,
+	                                           obj, NULL))
+		return "error setting timeout functions";
+
+	if (!dbus_connection_add_filter(conn, disconnect_filter, obj, NULL))
+		return "out of memory";
+
+	if (!dbus_connection_set_data(conn, bus_slot, obj, NULL))
+		return "out of memory";
+
+	obj->conn = conn;
+	obj->disconnected = 0;
+	return NULL;
+}
+
+/*
+ * Wraps conn in a new bus object using the Bus metatable at
+ * index meta, or closes it and pushes an error on failure.
+ */
+static int
+bus_wrap(lua_State *T, DBusConnection *conn, int meta)
+{
+	struct bus_object *obj;
+	const char *err;
+
+	/* create new userdata for the bus */
+	obj = lua_newuserdata(T, sizeof(struct bus_object));
+	obj->conn = NULL;
+	memset(&obj->stats, 0, sizeof(struct bus_stats));
+	obj->errors = LUA_NOREF;
+	obj->inflight = LUA_NOREF;
+	obj->classes = LUA_NOREF;
+	memset(obj->sendq, 0, sizeof(obj->sendq));
+	ev_prepare_init(&obj->prepare, prepare_handler);
+	obj->dirty = NULL;
+	obj->calls = NULL;
+	memset(&obj->call_latency, 0, sizeof(struct hist_table));
+	memset(&obj->handler_latency, 0, sizeof(struct hist_table));
+	obj->peer = 0;
+	obj->capture = NULL;
+	obj->monitor = NULL;
+	obj->disconnect_T = NULL;
+	obj->disconnected = 0;
+	obj->offload = OFFLOAD_DEFAULT;
+	obj->hello = NULL;
+	obj->held = NULL;
+	obj->held_tail = &obj->held;
+
+	err = bus_setconn(obj, conn);
+	if (err) {
+		dbus_connection_close(conn);
+		dbus_connection_unref(conn);
+		lua_pushnil(T);
+		lua_pushstring(T, err);
+		return 2;
+	}
+
+	/* set the metatable */
+	lua_pushvalue(T, meta);
+	lua_setmetatable(T, -2);
+
+	/* create error counters */
+	lua_createtable(T, 0, 2);
+	lua_newtable(T);
+	lua_setfield(T, -2, "received");
+	lua_newtable(T);
+	lua_setfield(T, -2, "sent");
+	obj->errors = luaL_ref(T, LUA_REGISTRYINDEX);
+
+	/* create the table of shared calls in flight */
+	lua_newtable(T);
+	obj->inflight = luaL_ref(T, LUA_REGISTRYINDEX);
+
+	/* create uservalue table */
+	lua_createtable(T, 3, 0);
+	/* create signal handler table */
+	lua_newtable(T);
+	lua_rawseti(T, -2, 1);
+	/* create object path table */
+	lua_newtable(T);
+	lua_rawseti(T, -2, 2);
+	/* set uservalue table */
+	lua_setuservalue(T, -2);
+
+	/* return the bus object */
+	return 1;
+}
+
+/*
+ * open()
+ *
+ * argument 1: uri to connect to
+ * argument 2: true if it is a peer (optional)
+ *
+ * Connections to a Server of another process are peers,
+ * there is no bus daemon to say Hello to or add match rules to.
+ */
+static int
+bus_open(lua_State *T)
+{
+	const char *uri;
+	DBusError err;
+	DBusConnection *conn;
+
+	uri = luaL_checkstring(T, 1);
+	lem_debug("opening %s", uri);
+
+	dbus_error_init(&err);
+	conn = dbus_connection_open_private(uri, &err);
+
+	if (dbus_error_is_set(&err)) {
+		lua_pushnil(T);
+		lua_pushstring(T, err.message);
+		dbus_error_free(&err);
+		return 2;
+	}
+
+	if (conn == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "error opening connection");
+		return 2;
+	}
+
+	if (bus_wrap(T, conn, lua_upvalueindex(1)) != 1)
+		return 2;
+	((struct bus_object *)lua_touserdata(T, -1))->peer = lua_toboolean(T, 2);
+	return 1;
+}
+
+/*
+ * Send what was held back while Hello was waiting for its
+ * reply, or fail it all with err.
+ */
+static void
+hello_release(struct bus_object *bus, const char *err)
+{
+	struct held *h;
+
+	/* Hello is also answered when the connection is lost */
+	if (err == NULL && !dbus_connection_get_is_connected(bus->conn))
+		err = "disconnected";
+
+	bus->hello = NULL;
+	while ((h = bus->held)) {
+		lua_State *S = h->T;
+		const char *msg = err;
+
+		bus->held = h->next;
+		if (msg == NULL) {
+			if (h->orig)
+				msg = forward_send(S, bus, h->msg,
+				                   h->orig, h->from);
+			else if (call_send(S, bus, h->msg, bus_call_cb) == NULL)
+				msg = "out of memory";
+		}
+
+		if (msg) {
+			lua_pushnil(S);
+			lua_pushstring(S, msg);
+			lem_queue(S, 2);
+		} else if (h->orig) {
+			lua_pushboolean(S, 1);
+			lem_queue(S, 1);
+		}
+
+		dbus_message_unref(h->msg);
+		if (h->orig) {
+			dbus_message_unref(h->orig);
+			dbus_connection_unref(h->from);
+		}
+		free(h);
+	}
+	bus->held_tail = &bus->held;
+
+	/* and whatever waits in the send classes */
+	if (bus->conn)
+		ev_prepare_start(LEM_ &bus->prepare);
+}
+
+static void
+hello_cb(DBusPendingCall *pending, void *data)
+{
+	struct call *c = data;
+
+	hello_release(c->bus, NULL);
+	bus_call_cb(pending, data);
+}
+
+/*
+ * Bus:reopen()
+ *
+ * argument 1: bus object
+ * argument 2: address
+ *
+ * Replaces the connection of the bus by a new one to address,
+ * usually after the old one was lost. Handlers, the signal and
+ * object tables, and a thread listening on the bus all carry
+ * over to the new connection, while calls still waiting for a
+ * reply on the old one fail right away. Anything else owned
+ * by the old connection, like its unique name, names and match
+ * rules, is gone and must be asked for again.
+ *
+ * Unless the bus is a peer, Hello is the first message sent on
+ * the new connection and the new unique name is returned once
+ * it is answered. Until then anything else sent on the bus is
+ * held back, as the bus daemon drops clients which don't say
+ * Hello first.
+ */
+static int
+bus_reopen(lua_State *T)
+{
+	struct bus_object *obj;
+	const char *uri;
+	DBusError err;
+	DBusConnection *conn;
+	struct call_link *l;
+	const char *msg;
+	DBusMessage *hello;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	uri = luaL_checkstring(T, 2);
+	obj = lua_touserdata(T, 1);
+
+	/* Bus:close() drops the uservalue, such buses stay closed */
+	lua_settop(T, 2);
+	lua_getuservalue(T, 1);
+	if (lua_type(T, 3) != LUA_TTABLE)
+		return bus_closed(T);
+
+	lem_debug("reopening %s", uri);
+
+	dbus_error_init(&err);
+	conn = dbus_connection_open_private(uri, &err);
+
+	if (dbus_error_is_set(&err)) {
+		lua_pushnil(T);
+		lua_pushstring(T, err.message);
+		dbus_error_free(&err);
+		return 2;
+	}
+
+	if (conn == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "error opening connection");
+		return 2;
+	}
+
+	if (obj->conn) {
+		monitor_stop(obj, "closed");
+		while ((l = obj->calls)) {
+			DBusPendingCall *pending = l->pending;
+
+			calls_remove(l);
+			dbus_pending_call_cancel(pending);
+			call_fail(T, l, "disconnected");
+			dbus_pending_call_unref(pending);
+			obj->stats.pending--;
+		}
+		sendq_clear(obj);
+		ev_prepare_stop(LEM_ &obj->prepare);
+		(void)dbus_connection_set_data(obj->conn, bus_slot, NULL, NULL);
+		dbus_connection_close(obj->conn);
+		dbus_connection_unref(obj->conn);
+		obj->conn = NULL;
+	}
+
+	msg = bus_setconn(obj, conn);
+	if (msg) {
+		dbus_connection_close(conn);
+		dbus_connection_unref(conn);
+		lua_pushnil(T);
+		lua_pushstring(T, msg);
+		return 2;
+	}
+
+	/* move the listener over */
+	lua_rawgeti(T, 3, 3);
+	if (lua_isthread(T, -1) &&
+	    !dbus_connection_add_filter(conn, message_filter,
+	                                lua_tothread(T, -1), NULL))
+		goto oom;
+
+	if (obj->peer) {
+		lua_pushboolean(T, 1);
+		return 1;
+	}
+
+	hello = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+	                                     DBUS_PATH_DBUS,
+	                                     DBUS_INTERFACE_DBUS,
+	                                     "Hello");
+	if (hello == NULL)
+		goto oom;
+
+	obj->hello = call_send(T, obj, hello, hello_cb);
+	dbus_message_unref(hello);
+	if (obj->hello == NULL)
+		goto oom;
+
+	return lua_yield(T, 0);
+
+oom:
+	lua_pushnil(T);
+	lua_pushliteral(T, "out of memory");
+	return 2;
+}
+
+/*
+ * The server side of a pair() is a libdbus server which
+ * is driven by hand for just long enough to accept the
+ * one connection made to it.
+ */
+#define PAIR_WATCHES 4
+
+struct pair_server {
+	DBusWatch *watches[PAIR_WATCHES];
+	int nwatches;
+	DBusConnection *conn;
+};
+
+static dbus_bool_t
+pair_watch_add(DBusWatch *watch, void *data)
+{
+	struct pair_server *s = data;
+
+	if (s->nwatches == PAIR_WATCHES)
+		return FALSE;
+
+	s->watches[s->nwatches++] = watch;
+	return TRUE;
+}
+
+static void
+pair_watch_remove(DBusWatch *watch, void *data)
+{
+	struct pair_server *s = data;
+	int i;
+
+	for (i = 0; i < s->nwatches; i++) {
+		if (s->watches[i] == watch) {
+			s->watches[i] = s->watches[--s->nwatches];
+			break;
+		}
+	}
+}
+
+static void
+pair_new_connection(DBusServer *server, DBusConnection *conn, void *data)
+{
+	struct pair_server *s = data;
+
+	(void)server;
+
+	/* connections not referenced here are dropped by libdbus */
+	if (s->conn == NULL)
+		s->conn = dbus_connection_ref(conn);
+}
+
+/*
+ * pair()
+ *
+ * Returns two bus objects connected directly to each other.
+ * Messages sent on one are received by the other, there is no
+ * bus daemon so no unique names and no match rules.
+ */
+static int
+bus_pair(lua_State *T)
+{
+	struct pair_server s;
+	DBusError err;
+	DBusServer *server;
+	DBusConnection *client;
+	char *address;
+	int i;
+
+	memset(&s, 0, sizeof(struct pair_server));
+	dbus_error_init(&err);
+
+	server = dbus_server_listen("unix:tmpdir=/tmp", &err);
+	if (server == NULL)
+		goto error;
+
+	dbus_server_set_new_connection_function(server,
+			pair_new_connection, &s, NULL);
+	if (!dbus_server_set_watch_functions(server,
+				pair_watch_add, pair_watch_remove, NULL,
+				&s, NULL) ||
+	    (address = dbus_server_get_address(server)) == NULL) {
+		dbus_server_disconnect(server);
+		dbus_server_unref(server);
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	client = dbus_connection_open_private(address, &err);
+	dbus_free(address);
+
+	/* the new connection is waiting in the listen backlog,
+	 * so handling the server watch accepts it right away */
+	for (i = 0; client && i < s.nwatches && s.conn == NULL; i++) {
+		if (dbus_watch_get_enabled(s.watches[i]))
+			dbus_watch_handle(s.watches[i], DBUS_WATCH_READABLE);
+	}
+
+	/* stop listening, this leaves the accepted connection alone */
+	dbus_server_disconnect(server);
+	dbus_server_unref(server);
+
+	if (client == NULL)
+		goto error;
+
+	if (s.conn == NULL) {
+		dbus_connection_close(client);
+		dbus_connection_unref(client);
+		lua_pushnil(T);
+		lua_pushliteral(T, "error accepting connection");
+		return 2;
+	}
+
+	lua_settop(T, 0);
+	if (bus_wrap(T, client, lua_upvalueindex(1)) != 1) {
+		dbus_connection_close(s.conn);
+		dbus_connection_unref(s.conn);
+		return 2;
+	}
+	((struct bus_object *)lua_touserdata(T, 1))->peer = 1;
+
+	if (bus_wrap(T, s.conn, lua_upvalueindex(1)) != 1)
+		return 2;
+	((struct bus_object *)lua_touserdata(T, 2))->peer = 1;
+
+	return 2;
+
+error:
+	lua_pushnil(T);
+	lua_pushstring(T, err.message);
+	dbus_error_free(&err);
+	return 2;
+}
+
+/*
+ * A libdbus server accepting peer connections, eg. from worker
+ * processes. Connections are accepted as soon as they arrive and
+ * wait in a small backlog until Server:accept() picks them up.
+ */
+#define LEM_DBUS_SERVER_META "lem.dbus.Server"
+#define SERVER_BACKLOG 16
+
+struct server_object {
+	DBusServer *server;
+	DBusConnection *backlog[SERVER_BACKLOG];
+	unsigned int head;
+	unsigned int count;
+	int meta; /* registry reference to the Bus metatable */
+	lua_State *T; /* thread waiting in Server:accept() */
+};
+
+struct server_watch {
+	struct ev_io ev;
+	DBusWatch *watch;
+};
+
+static void
+server_watch_handler(EV_P_ struct ev_io *ev, int revents)
+{
+	struct server_watch *w = (struct server_watch *)ev;
+	unsigned int flags = 0;
+
+	if (revents & EV_READ)
+		flags |= DBUS_WATCH_READABLE;
+	if (revents & EV_WRITE)
+		flags |= DBUS_WATCH_WRITABLE;
+	if (revents & EV_ERROR)
+		flags |= DBUS_WATCH_ERROR;
+
+	(void)dbus_watch_handle(w->watch, flags);
+}
+
+static dbus_bool_t
+server_watch_add(DBusWatch *watch, void *data)
+{
+	struct server_watch *w;
+
+	(void)data;
+
+	w = lem_xmalloc(sizeof(struct server_watch));
+	ev_io_init(&w->ev, server_watch_handler, dbus_watch_get_unix_fd(watch),
+	           flags_to_revents(dbus_watch_get_flags(watch)));
+	w->watch = watch;
+	dbus_watch_set_data(watch, w, NULL);
+
+	if (dbus_watch_get_enabled(watch))
+		ev_io_start(LEM_ &w->ev);
+
+	return TRUE;
+}
+
+static void
+server_watch_remove(DBusWatch *watch, void *data)
+{
+	struct server_watch *w = dbus_watch_get_data(watch);
+
+	(void)data;
+
+	ev_io_stop(LEM_ &w->ev);
+	free(w);
+}
+
+static void
+server_watch_toggle(DBusWatch *watch, void *data)
+{
+	struct server_watch *w = dbus_watch_get_data(watch);
+
+	(void)data;
+
+	if (dbus_watch_get_enabled(watch))
+		ev_io_start(LEM_ &w->ev);
+	else
+		ev_io_stop(LEM_ &w->ev);
+}
+
+/*
+ * Wrap conn in a new bus object on the stack of T.
+ * Returns the number of values pushed.
+ */
+static int
+server_wrap(lua_State *T, struct server_object *s, DBusConnection *conn)
+{
+	int meta = lua_gettop(T) + 1;
+	int ret;
+
+	lua_rawgeti(T, LUA_REGISTRYINDEX, s->meta);
+	ret = bus_wrap(T, conn, meta);
+	lua_remove(T, meta);
+	if (ret == 1)
+		((struct bus_object *)lua_touserdata(T, -1))->peer = 1;
+	return ret;
+}
+
+static void
+server_new_connection(DBusServer *server, DBusConnection *conn, void *data)
+{
+	struct server_object *s = data;
+	lua_State *T = s->T;
+
+	(void)server;
+
+	lem_debug("new connection");
+
+	/* the connection is unreferenced when this returns */
+	dbus_connection_ref(conn);
+
+	if (T) {
+		s->T = NULL;
+		lua_settop(T, 0);
+		lem_queue(T, server_wrap(T, s, conn));
+		return;
+	}
+
+	if (s->count == SERVER_BACKLOG) {
+		lem_debug("backlog full, dropping connection");
+		dbus_connection_close(conn);
+		dbus_connection_unref(conn);
+		return;
+	}
+
+	s->backlog[(s->head + s->count) % SERVER_BACKLOG] = conn;
+	s->count++;
+}
+
+static void
+server_stop(lua_State *T, struct server_object *s)
+{
+	if (s->server == NULL)
+		return;
+
+	dbus_server_disconnect(s->server);
+	dbus_server_unref(s->server);
+	s->server = NULL;
+
+	while (s->count > 0) {
+		DBusConnection *conn = s->backlog[s->head];
+
+		dbus_connection_close(conn);
+		dbus_connection_unref(conn);
+		s->head = (s->head + 1) % SERVER_BACKLOG;
+		s->count--;
+	}
+
+	if (s->T) {
+		lua_State *S = s->T;
+
+		s->T = NULL;
+		lua_settop(S, 0);
+		lua_pushnil(S);
+		lua_pushliteral(S, "closed");
+		lem_queue(S, 2);
 	}
 
-	lem_debug("Hmm.. received %s message",
-	          dbus_message_type_to_string(dbus_message_get_type(msg)));
-	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	luaL_unref(T, LUA_REGISTRYINDEX, s->meta);
+	s->meta = LUA_NOREF;
 }
 
 /*
- * DBus.listen()
+ * newserver()
  *
- * argument 1: bus object
+ * argument 1: address, eg. unix:tmpdir=/tmp
+ *
+ * Returns a new Server object accepting peer connections.
  */
 static int
-bus_listen(lua_State *T)
+server_new(lua_State *T)
 {
-	DBusConnection *conn;
+	const char *address;
+	struct server_object *s;
+	DBusError err;
 
-	luaL_checktype(T, 1, LUA_TUSERDATA);
-	conn = bus_unbox(T, 1);
-	if (conn == NULL)
-		return bus_closed(T);
+	address = luaL_checkstring(T, 1);
 
-	lua_settop(T, 1);
-	lua_getuservalue(T, 1);
-	lua_rawgeti(T, 2, 3);
-	if (lua_isthread(T, -1)) {
+	s = lua_newuserdata(T, sizeof(struct server_object));
+	s->server = NULL;
+	s->head = 0;
+	s->count = 0;
+	s->meta = LUA_NOREF;
+	s->T = NULL;
+	luaL_getmetatable(T, LEM_DBUS_SERVER_META);
+	lua_setmetatable(T, -2);
+
+	dbus_error_init(&err);
+	s->server = dbus_server_listen(address, &err);
+	if (s->server == NULL) {
 		lua_pushnil(T);
-		lua_pushliteral(T, "busy");
+		lua_pushstring(T, err.message);
+		dbus_error_free(&err);
 		return 2;
 	}
-	lua_pop(T, 1);
 
-	/* set the message filter */
-	if (!dbus_connection_add_filter(conn, message_filter, T, NULL)) {
-		dbus_connection_close(conn);
-		dbus_connection_unref(conn);
+	dbus_server_set_new_connection_function(s->server,
+			server_new_connection, s, NULL);
+	if (!dbus_server_set_watch_functions(s->server,
+				server_watch_add, server_watch_remove,
+				server_watch_toggle, s, NULL)) {
+		dbus_server_disconnect(s->server);
+		dbus_server_unref(s->server);
+		s->server = NULL;
 		lua_pushnil(T);
-		lua_pushliteral(T, "out of memory");
+		lua_pushliteral(T, "error setting watch functions");
 		return 2;
 	}
 
-	lua_pushthread(T);
-	lua_rawseti(T, 2, 3);
-
-	/* push signal table */
-	lua_rawgeti(T, 2, 1);
-	/* push object table */
-	lua_rawgeti(T, 2, 2);
-	/* push message metatable */
 	lua_pushvalue(T, lua_upvalueindex(1));
-	lua_replace(T, LEM_DBUS_MESSAGE_META);
-
-	return lua_yield(T, LEM_DBUS_TOP);
+	s->meta = luaL_ref(T, LUA_REGISTRYINDEX);
+	return 1;
 }
 
 /*
- * DBus.interrupt()
+ * Server:address()
  *
- * argument 1: bus object
+ * argument 1: server object
+ *
+ * Returns the address for peers to connect to.
  */
 static int
-bus_interrupt(lua_State *T)
+server_address(lua_State *T)
 {
-	DBusConnection *conn;
-	lua_State *S;
+	struct server_object *s = luaL_checkudata(T, 1, LEM_DBUS_SERVER_META);
+	char *address;
 
-	luaL_checktype(T, 1, LUA_TUSERDATA);
-	conn = bus_unbox(T, 1);
-	if (conn == NULL)
+	if (s->server == NULL)
 		return bus_closed(T);
 
-	lua_settop(T, 1);
-	lua_getuservalue(T, 1);
-	lua_rawgeti(T, 2, 3);
-	if (!lua_isthread(T, -1)) {
+	address = dbus_server_get_address(s->server);
+	if (address == NULL) {
 		lua_pushnil(T);
-		lua_pushliteral(T, "not busy");
+		lua_pushliteral(T, "out of memory");
 		return 2;
 	}
-	S = lua_tothread(T, -1);
-	lua_pop(T, 1);
-	lua_pushnil(T);
-	lua_rawseti(T, -2, 3);
-
-	lua_settop(S, 0);
-	lua_pushnil(S);
-	lua_pushliteral(S, "interrupted");
-	lem_queue(S, 2);
-
-	dbus_connection_remove_filter(conn, message_filter, S);
 
-	lua_pushboolean(T, 1);
+	lua_pushstring(T, address);
+	dbus_free(address);
 	return 1;
 }
 
 /*
- * DBus.__gc()
+ * Server:accept()
  *
- * argument 1: bus object
+ * argument 1: server object
+ *
+ * Returns a Bus object for the next peer to connect,
+ * waiting for one if none is in the backlog.
  */
 static int
-bus_gc(lua_State *T)
+server_accept(lua_State *T)
 {
-	DBusConnection *conn = bus_unbox(T, 1);
+	struct server_object *s = luaL_checkudata(T, 1, LEM_DBUS_SERVER_META);
+	DBusConnection *conn;
 
-	lem_debug("collecting DBus connection");
+	if (s->server == NULL)
+		return bus_closed(T);
 
-	if (conn) {
-		dbus_connection_close(conn);
-		dbus_connection_unref(conn);
+	if (s->count == 0) {
+		if (s->T) {
+			lua_pushnil(T);
+			lua_pushliteral(T, "busy");
+			return 2;
+		}
+		s->T = T;
+		return lua_yield(T, 0);
 	}
 
+	conn = s->backlog[s->head];
+	s->head = (s->head + 1) % SERVER_BACKLOG;
+	s->count--;
+
+	lua_settop(T, 0);
+	return server_wrap(T, s, conn);
+}
+
+/*
+ * Server:close()
+ *
+ * argument 1: server object
+ *
+ * Stops accepting connections, those already
+ * accepted are left alone.
+ */
+static int
+server_close(lua_State *T)
+{
+	struct server_object *s = luaL_checkudata(T, 1, LEM_DBUS_SERVER_META);
+
+	if (s->server == NULL)
+		return bus_closed(T);
+
+	server_stop(T, s);
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static int
+server_gc(lua_State *T)
+{
+	server_stop(T, lua_touserdata(T, 1));
 	return 0;
 }
 
 /*
- * Bus:close()
+ * Bus:pending()
  *
  * argument 1: bus object
+ *
+ * Returns the number of calls waiting for a reply, like
+ * Bus:stats().pending without creating a table.
  */
 static int
-bus_close(lua_State *T)
+bus_pending(lua_State *T)
 {
-	struct bus_object *obj;
+	struct bus_object *bus;
 
 	luaL_checktype(T, 1, LUA_TUSERDATA);
-	obj = lua_touserdata(T, 1);
-	if (obj->conn == NULL)
+	bus = lua_touserdata(T, 1);
+	if (bus->conn == NULL)
 		return bus_closed(T);
 
-	lem_debug("closing DBus connection");
+	lua_pushnumber(T, (lua_Number)bus->stats.pending);
+	return 1;
+}
 
-	dbus_connection_close(obj->conn);
-	dbus_connection_unref(obj->conn);
-	obj->conn = NULL;
+/*
+ * Encode the signature and arguments given to marshal()
+ * as a method return. Raises an error if the values don't
+ * match the signature, returns NULL if out of memory.
+ */
+static DBusMessage *
+marshal_message(lua_State *T)
+{
+	const char *signature = luaL_checkstring(T, 1);
+	DBusMessage *msg;
 
-	lua_getuservalue(T, 1);
-	lua_rawgeti(T, -1, 3);
-	if (lua_isthread(T, -1)) {
-		lua_State *S = lua_tothread(T, -1);
+	msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (msg == NULL)
+		return NULL;
 
-		lua_settop(S, 0);
-		lua_pushnil(S);
-		lua_pushliteral(S, "interrupted");
-		lem_queue(S, 2);
+	/* the message must have a serial and, being a method
+	 * return, a reply serial to pass validation when
+	 * unmarshalled */
+	dbus_message_set_serial(msg, 1);
+	if (!dbus_message_set_reply_serial(msg, 1)) {
+		dbus_message_unref(msg);
+		return NULL;
 	}
 
-	lua_pushnil(T);
-	lua_setuservalue(T, 1);
-	lua_pushboolean(T, 1);
-	return 1;
+	if (signature[0] != '\0' &&
+	    lem_dbus_add_arguments(T, 2, signature, msg)) {
+		dbus_message_unref(msg);
+		luaL_error(T, "%s", lua_tostring(T, -1));
+	}
+
+	if (dbus_message_contains_unix_fds(msg)) {
+		dbus_message_unref(msg);
+		luaL_error(T, "cannot marshal file descriptors");
+	}
+
+	return msg;
 }
 
 /*
- * open()
+ * marshal()
  *
- * argument 1: uri to connect to
+ * argument 1: signature
+ * ...
+ *
+ * Returns the arguments encoded as a method return message
+ * in wire format. Pass it to unmarshal() to get the arguments
+ * back, or to a method reply function as reply(false, bytes)
+ * to answer a call without encoding the arguments again.
  */
 static int
-bus_open(lua_State *T)
+marshal(lua_State *T)
 {
-	const char *uri;
-	DBusError err;
-	DBusConnection *conn;
-	struct bus_object *obj;
+	DBusMessage *msg;
+	char *data;
+	int len;
 
-	uri = luaL_checkstring(T, 1);
-	lem_debug("opening %s", uri);
+	msg = marshal_message(T);
+	if (msg == NULL)
+		goto oom;
 
-	dbus_error_init(&err);
-	conn = dbus_connection_open_private(uri, &err);
+	if (!dbus_message_marshal(msg, &data, &len))
+		goto oom;
 
-	if (dbus_error_is_set(&err)) {
-		lua_pushnil(T);
-		lua_pushstring(T, err.message);
-		dbus_error_free(&err);
-		return 2;
-	}
+	dbus_message_unref(msg);
+	lua_pushlstring(T, data, len);
+	dbus_free(data);
+	return 1;
 
-	if (conn == NULL) {
+oom:
+	if (msg)
+		dbus_message_unref(msg);
+	lua_pushnil(T);
+	lua_pushliteral(T, "out of memory");
+	return 2;
+}
+
+/*
+ * newreply()
+ *
+ * argument 1: signature
+ * ...
+ *
+ * Like marshal(), but returns a Reply object keeping the
+ * encoded message as it is. Answering a call with it as
+ * reply(false, encoded) only copies and readdresses it.
+ */
+static int
+reply_new(lua_State *T)
+{
+	DBusMessage *msg = marshal_message(T);
+	DBusMessage **encoded;
+
+	if (msg == NULL) {
 		lua_pushnil(T);
-		lua_pushliteral(T, "error opening connection");
+		lua_pushliteral(T, "out of memory");
 		return 2;
 	}
 
-	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+	encoded = lua_newuserdata(T, sizeof(DBusMessage *));
+	*encoded = msg;
+	luaL_getmetatable(T, LEM_DBUS_REPLY_META);
+	lua_setmetatable(T, -2);
+	return 1;
+}
 
-	/* set watch functions */
-	if (!dbus_connection_set_watch_functions(conn,
-	                                         watch_add,
-	                                         watch_remove,
-	                                         watch_toggle,
-	                                         conn, NULL)) {
-		dbus_connection_close(conn);
-		dbus_connection_unref(conn);
-		lua_pushnil(T);
-		lua_pushliteral(T, "error setting watch functions");
-		return 2;
+static int
+reply_gc(lua_State *T)
+{
+	DBusMessage **encoded = lua_touserdata(T, 1);
+
+	if (*encoded) {
+		dbus_message_unref(*encoded);
+		*encoded = NULL;
 	}
+	return 0;
+}
 
-	/* set timout functions */
-	if (!dbus_connection_set_timeout_functions(conn,
-	                                           timeout_add,
-	                                           timeout_remove,
-	                                           timeout_toggle,
-	                                           conn, NULL)) {
-		dbus_connection_close(conn);
-		dbus_connection_unref(conn);
+/*
+ * unmarshal()
+ *
+ * argument 1: message in wire format
+ *
+ * Returns the signature followed by the arguments
+ * of the message.
+ */
+static int
+unmarshal(lua_State *T)
+{
+	size_t len;
+	const char *data = luaL_checklstring(T, 1, &len);
+	DBusError err;
+	DBusMessage *msg;
+	int nargs;
+
+	dbus_error_init(&err);
+	msg = dbus_message_demarshal(data, (int)len, &err);
+	if (msg == NULL) {
 		lua_pushnil(T);
-		lua_pushliteral(T, "error setting timeout functions");
+		if (dbus_error_is_set(&err)) {
+			lua_pushstring(T, err.message);
+			dbus_error_free(&err);
+		} else
+			lua_pushliteral(T, "out of memory");
 		return 2;
 	}
 
-	/* create new userdata for the bus */
-	obj = lua_newuserdata(T, sizeof(struct bus_object));
-	obj->conn = conn;
-
-	/* set the metatable */
-	lua_pushvalue(T, lua_upvalueindex(1));
-	lua_setmetatable(T, -2);
-
-	/* create uservalue table */
-	lua_createtable(T, 3, 0);
-	/* create signal handler table */
-	lua_newtable(T);
-	lua_rawseti(T, -2, 1);
-	/* create object path table */
-	lua_newtable(T);
-	lua_rawseti(T, -2, 2);
-	/* set uservalue table */
-	lua_setuservalue(T, -2);
-
-	/* return the bus object */
-	return 1;
+	lua_settop(T, 0);
+	lua_pushstring(T, dbus_message_get_signature(msg));
+	nargs = lem_dbus_push_arguments(T, msg);
+	dbus_message_unref(msg);
+	return nargs + 1;
 }
 
 #define set_dbus_string_constant(L, name) \
@@ -887,17 +4311,45 @@ int
 luaopen_lem_dbus_core(lua_State *L)
 {
 	luaL_Reg bus_funcs[] = {
-		{ "__gc",        bus_gc },
-		{ "signaltable", bus_signaltable },
-		{ "objecttable", bus_objecttable },
-		{ "call",        bus_call },
-		{ "signal",      bus_signal },
-		{ "close",       bus_close },
-		{ "interrupt",   bus_interrupt },
-		{ NULL,          NULL }
+		{ "__gc",         bus_gc },
+		{ "signaltable",  bus_signaltable },
+		{ "objecttable",  bus_objecttable },
+		{ "cansendfd",    bus_cansendfd },
+		{ "ispeer",       bus_ispeer },
+		{ "stats",        bus_stats },
+		{ "resetstats",   bus_resetstats },
+		{ "latency",      bus_latency },
+		{ "resetlatency", bus_resetlatency },
+		{ "capture",      bus_capture },
+		{ "sendraw",      bus_sendraw },
+		{ "setpriority",  bus_setpriority },
+		{ "setoffload",   bus_setoffload },
+		{ "forward",      bus_forward },
+		{ "setmonitor",   bus_setmonitor },
+		{ "stopmonitor",  bus_stopmonitor },
+		{ "nextmessage",  bus_nextmessage },
+		{ "call",         bus_call },
+		{ "callshared",   bus_callshared },
+		{ "trycall",      bus_trycall },
+		{ "trycallshared", bus_trycallshared },
+		{ "failcalls",    bus_failcalls },
+		{ "pending",      bus_pending },
+		{ "reopen",       bus_reopen },
+		{ "waitdisconnect", bus_waitdisconnect },
+		{ "signal",       bus_signal },
+		{ "close",        bus_close },
+		{ "interrupt",    bus_interrupt },
+		{ NULL,           NULL }
 	};
 	luaL_Reg *p;
 
+	/* replies may be decoded on lem's worker threads */
+	if (!dbus_threads_init_default())
+		return luaL_error(L, "error initializing DBus threads");
+
+	if (!dbus_connection_allocate_data_slot(&bus_slot))
+		return luaL_error(L, "out of memory");
+
 	/* create a table for this module */
 	lua_newtable(L);
 
@@ -911,6 +4363,16 @@ luaopen_lem_dbus_core(lua_State *L)
 	lua_pushcclosure(L, bus_open, 1);
 	lua_setfield(L, -3, "open");
 
+	/* insert the newserver() function */
+	lua_pushvalue(L, -1); /* upvalue 1: Bus metatable */
+	lua_pushcclosure(L, server_new, 1);
+	lua_setfield(L, -3, "newserver");
+
+	/* insert the pair() function */
+	lua_pushvalue(L, -1); /* upvalue 1: Bus metatable */
+	lua_pushcclosure(L, bus_pair, 1);
+	lua_setfield(L, -3, "pair");
+
 	/* insert Bus methods */
 	for (p = bus_funcs; p->name; p++) {
 		lua_pushcfunction(L, p->func);
@@ -964,6 +4426,98 @@ luaopen_lem_dbus_core(lua_State *L)
 	/* insert the Proxy metatable */
 	lua_setfield(L, -2, "Proxy");
 
+	/* insert the UnixFD metatable */
+	lem_dbus_fd_open(L);
+	lua_pushcfunction(L, lem_dbus_blob_map);
+	lua_setfield(L, -2, "map");
+	lua_setfield(L, -2, "UnixFD");
+
+	/* insert the Blob metatable */
+	lem_dbus_blob_open(L);
+	lua_setfield(L, -2, "Blob");
+
+	/* insert the newblob() function */
+	lua_pushcfunction(L, lem_dbus_blob_new);
+	lua_setfield(L, -2, "newblob");
+
+	/* insert the Ring metatable */
+	lem_dbus_ring_open(L);
+	lua_setfield(L, -2, "Ring");
+
+	/* insert the newring() and openring() functions */
+	lua_pushcfunction(L, lem_dbus_ring_new);
+	lua_setfield(L, -2, "newring");
+	lua_pushcfunction(L, lem_dbus_ring_attach);
+	lua_setfield(L, -2, "openring");
+
+	/* insert the Message metatable */
+	lem_dbus_message_open(L);
+	lua_pushcfunction(L, message_error);
+	lua_setfield(L, -2, "error");
+	lua_setfield(L, -2, "Message");
+
+	/* insert the Limit metatable */
+	lem_dbus_limit_open(L);
+	lua_setfield(L, -2, "Limit");
+
+	/* insert the newlimit() function */
+	lua_pushcfunction(L, lem_dbus_limit_new);
+	lua_setfield(L, -2, "newlimit");
+
+	/* insert the Match metatable */
+	lem_dbus_match_open(L);
+	lua_setfield(L, -2, "Match");
+
+	/* insert the newmatch() function */
+	lua_pushcfunction(L, lem_dbus_match_new);
+	lua_setfield(L, -2, "newmatch");
+
+	/* insert the Latest metatable */
+	lem_dbus_latest_open(L);
+	lua_setfield(L, -2, "Latest");
+
+	/* insert the newlatest() function */
+	lua_pushcfunction(L, lem_dbus_latest_new);
+	lua_setfield(L, -2, "newlatest");
+
+	/* insert the Server metatable */
+	luaL_newmetatable(L, LEM_DBUS_SERVER_META);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, server_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, server_address);
+	lua_setfield(L, -2, "address");
+	lua_pushcfunction(L, server_accept);
+	lua_setfield(L, -2, "accept");
+	lua_pushcfunction(L, server_close);
+	lua_setfield(L, -2, "close");
+	lua_setfield(L, -2, "Server");
+
+	/* insert the Capture metatable */
+	lem_dbus_capture_open(L);
+	lua_setfield(L, -2, "Capture");
+
+	/* insert the opencapture() function */
+	lua_pushcfunction(L, lem_dbus_capture_new);
+	lua_setfield(L, -2, "opencapture");
+
+	/* insert the marshal() and unmarshal() functions */
+	lua_pushcfunction(L, marshal);
+	lua_setfield(L, -2, "marshal");
+	lua_pushcfunction(L, unmarshal);
+	lua_setfield(L, -2, "unmarshal");
+
+	/* insert the Reply metatable */
+	luaL_newmetatable(L, LEM_DBUS_REPLY_META);
+	lua_pushcfunction(L, reply_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setfield(L, -2, "Reply");
+
+	/* insert the newreply() function */
+	lua_pushcfunction(L, reply_new);
+	lua_setfield(L, -2, "newreply");
+
 	/* insert constants */
 	set_dbus_string_constant(L, SERVICE_DBUS);
 	set_dbus_string_constant(L, PATH_DBUS);
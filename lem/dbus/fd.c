@@ -0,0 +1,173 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AMALG
+#include <unistd.h>
+#include <lem.h>
+
+#define EXPORT
+#endif
+
+#define LEM_DBUS_UNIXFD_META "lem.dbus.UnixFD"
+
+/*
+ * UnixFD objects own a file descriptor received over the bus.
+ * libdbus hands us a fresh dup() of every descriptor in a message,
+ * so it is ours to close unless stolen by the user.
+ */
+struct unixfd {
+	int fd;
+};
+
+static int
+unixfd_closed(lua_State *T)
+{
+	lua_pushnil(T);
+	lua_pushliteral(T, "closed");
+	return 2;
+}
+
+/*
+ * UnixFD:__gc()
+ */
+static int
+unixfd_gc(lua_State *T)
+{
+	struct unixfd *u = lua_touserdata(T, 1);
+
+	if (u->fd >= 0) {
+		lem_debug("collecting fd %d", u->fd);
+		(void)close(u->fd);
+		u->fd = -1;
+	}
+
+	return 0;
+}
+
+/*
+ * UnixFD:fileno()
+ */
+static int
+unixfd_fileno(lua_State *T)
+{
+	struct unixfd *u = luaL_checkudata(T, 1, LEM_DBUS_UNIXFD_META);
+
+	if (u->fd < 0)
+		return unixfd_closed(T);
+
+	lua_pushnumber(T, (lua_Number)u->fd);
+	return 1;
+}
+
+/*
+ * UnixFD:steal()
+ *
+ * Returns the raw descriptor and gives up ownership of it.
+ */
+static int
+unixfd_steal(lua_State *T)
+{
+	struct unixfd *u = luaL_checkudata(T, 1, LEM_DBUS_UNIXFD_META);
+
+	if (u->fd < 0)
+		return unixfd_closed(T);
+
+	lua_pushnumber(T, (lua_Number)u->fd);
+	u->fd = -1;
+	return 1;
+}
+
+/*
+ * UnixFD:close()
+ */
+static int
+unixfd_close(lua_State *T)
+{
+	struct unixfd *u = luaL_checkudata(T, 1, LEM_DBUS_UNIXFD_META);
+
+	if (u->fd < 0)
+		return unixfd_closed(T);
+
+	if (close(u->fd)) {
+		u->fd = -1;
+		lua_pushnil(T);
+		lua_pushliteral(T, "error closing file descriptor");
+		return 2;
+	}
+
+	u->fd = -1;
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+EXPORT void
+lem_dbus_fd_push(lua_State *L, int fd)
+{
+	struct unixfd *u = lua_newuserdata(L, sizeof(struct unixfd));
+
+	u->fd = fd;
+	luaL_getmetatable(L, LEM_DBUS_UNIXFD_META);
+	lua_setmetatable(L, -2);
+}
+
+/*
+ * Returns the file descriptor of the value at index,
+ * which may be a number, a UnixFD object or any other
+ * object with a fileno() method, or -1 if there is none.
+ */
+EXPORT int
+lem_dbus_fd_get(lua_State *L, int index)
+{
+	int fd;
+
+	if (lua_type(L, index) == LUA_TNUMBER)
+		return (int)lua_tonumber(L, index);
+
+	if (!lua_isuserdata(L, index) || !luaL_callmeta(L, index, "fileno"))
+		return -1;
+
+	fd = lua_isnumber(L, -1) ? (int)lua_tonumber(L, -1) : -1;
+	lua_pop(L, 1);
+	return fd;
+}
+
+/*
+ * Creates the UnixFD metatable, registers it and leaves
+ * it on top of the stack.
+ */
+EXPORT void
+lem_dbus_fd_open(lua_State *L)
+{
+	luaL_Reg unixfd_funcs[] = {
+		{ "__gc",   unixfd_gc },
+		{ "fileno", unixfd_fileno },
+		{ "steal",  unixfd_steal },
+		{ "close",  unixfd_close },
+		{ NULL,     NULL }
+	};
+	luaL_Reg *p;
+
+	luaL_newmetatable(L, LEM_DBUS_UNIXFD_META);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	for (p = unixfd_funcs; p->name; p++) {
+		lua_pushcfunction(L, p->func);
+		lua_setfield(L, -2, p->name);
+	}
+}
@@ -0,0 +1,308 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AMALG
+#include <stdlib.h>
+#include <string.h>
+#include <lem.h>
+#include <dbus/dbus.h>
+
+#include "flat.h"
+
+#define EXPORT
+#endif
+
+/*
+ * Arrays and structs are both tables of count values, dicts
+ * have count keys each followed by its value and variants are
+ * just the value inside, like lem_dbus_push_arguments() does.
+ */
+enum {
+	FLAT_NIL,
+	FLAT_BOOLEAN,
+	FLAT_NUMBER,
+	FLAT_STRING,
+	FLAT_ARRAY,
+	FLAT_DICT
+};
+
+struct flat_value {
+	int type;
+	unsigned int len; /* string length or number of elements */
+	union {
+		lua_Number n;
+		const char *s;
+	} u;
+};
+
+/*
+ * Estimate the size of the arguments of msg in bytes from the
+ * arrays and strings at the top level, without walking into them.
+ */
+EXPORT size_t
+lem_dbus_flat_size(DBusMessage *msg)
+{
+	DBusMessageIter args;
+	size_t size = 0;
+
+	if (!dbus_message_iter_init(msg, &args))
+		return 0;
+
+	do {
+		DBusMessageIter array;
+		const char *s;
+
+		switch (dbus_message_iter_get_arg_type(&args)) {
+		case DBUS_TYPE_ARRAY:
+			/* the byte length is exactly what we want here,
+			 * it's only deprecated as an element count */
+			dbus_message_iter_recurse(&args, &array);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+			size += dbus_message_iter_get_array_len(&array);
+#pragma GCC diagnostic pop
+			break;
+		case DBUS_TYPE_STRING:
+		case DBUS_TYPE_OBJECT_PATH:
+		case DBUS_TYPE_SIGNATURE:
+			dbus_message_iter_get_basic(&args, &s);
+			size += strlen(s);
+			break;
+		default:
+			size += 8;
+		}
+	} while (dbus_message_iter_next(&args));
+
+	return size;
+}
+
+static unsigned int
+flat_add(struct flat *f, int type)
+{
+	struct flat_value *v;
+
+	if (f->n == f->size) {
+		unsigned int size = f->size ? 2 * f->size : 64;
+
+		v = lem_xmalloc(size * sizeof(struct flat_value));
+		if (f->n)
+			memcpy(v, f->values, f->n * sizeof(struct flat_value));
+		free(f->values);
+		f->values = v;
+		f->size = size;
+	}
+
+	v = &f->values[f->n];
+	v->type = type;
+	v->len = 0;
+	return f->n++;
+}
+
+static void
+flat_number(struct flat *f, lua_Number n)
+{
+	unsigned int i = flat_add(f, FLAT_NUMBER);
+
+	f->values[i].u.n = n;
+}
+
+static void
+flat_walk_value(struct flat *f, DBusMessageIter *args)
+{
+	DBusBasicValue b;
+	DBusMessageIter sub;
+	unsigned int i;
+	unsigned int count = 0;
+
+	switch (dbus_message_iter_get_arg_type(args)) {
+	case DBUS_TYPE_BYTE:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.byt);
+		break;
+	case DBUS_TYPE_BOOLEAN:
+		dbus_message_iter_get_basic(args, &b);
+		i = flat_add(f, FLAT_BOOLEAN);
+		f->values[i].len = b.bool_val ? 1 : 0;
+		break;
+	case DBUS_TYPE_INT16:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.i16);
+		break;
+	case DBUS_TYPE_UINT16:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.u16);
+		break;
+	case DBUS_TYPE_INT32:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.i32);
+		break;
+	case DBUS_TYPE_UINT32:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.u32);
+		break;
+	case DBUS_TYPE_INT64:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.i64);
+		break;
+	case DBUS_TYPE_UINT64:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.u64);
+		break;
+	case DBUS_TYPE_DOUBLE:
+		dbus_message_iter_get_basic(args, &b);
+		flat_number(f, (lua_Number)b.dbl);
+		break;
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	case DBUS_TYPE_SIGNATURE:
+		dbus_message_iter_get_basic(args, &b);
+		i = flat_add(f, FLAT_STRING);
+		f->values[i].u.s = b.str;
+		f->values[i].len = strlen(b.str);
+		break;
+	case DBUS_TYPE_VARIANT:
+		dbus_message_iter_recurse(args, &sub);
+		flat_walk_value(f, &sub);
+		break;
+	case DBUS_TYPE_ARRAY:
+		if (dbus_message_iter_get_element_type(args) ==
+				DBUS_TYPE_DICT_ENTRY) {
+			i = flat_add(f, FLAT_DICT);
+			dbus_message_iter_recurse(args, &sub);
+			while (dbus_message_iter_get_arg_type(&sub) ==
+					DBUS_TYPE_DICT_ENTRY) {
+				DBusMessageIter entry;
+
+				dbus_message_iter_recurse(&sub, &entry);
+				flat_walk_value(f, &entry);
+				dbus_message_iter_next(&entry);
+				flat_walk_value(f, &entry);
+				count++;
+				dbus_message_iter_next(&sub);
+			}
+			/* f->values may have moved meanwhile */
+			f->values[i].len = count;
+			break;
+		}
+		/* fall through */
+	case DBUS_TYPE_STRUCT:
+		i = flat_add(f, FLAT_ARRAY);
+		dbus_message_iter_recurse(args, &sub);
+		while (dbus_message_iter_get_arg_type(&sub) !=
+				DBUS_TYPE_INVALID) {
+			flat_walk_value(f, &sub);
+			count++;
+			dbus_message_iter_next(&sub);
+		}
+		f->values[i].len = count;
+		break;
+	default:
+		/* file descriptors are dup'ed as they're read,
+		 * messages with them are never walked here */
+		flat_add(f, FLAT_NIL);
+	}
+}
+
+/*
+ * Walk the arguments of msg into f. This is safe to run
+ * outside the event loop, no Lua state is touched.
+ */
+EXPORT void
+lem_dbus_flat_walk(struct flat *f, DBusMessage *msg)
+{
+	DBusMessageIter args;
+
+	f->values = NULL;
+	f->n = 0;
+	f->size = 0;
+	f->argc = 0;
+
+	if (!dbus_message_iter_init(msg, &args))
+		return;
+
+	do {
+		f->argc++;
+		flat_walk_value(f, &args);
+	} while (dbus_message_iter_next(&args));
+}
+
+static struct flat_value *
+flat_push_value(lua_State *L, struct flat_value *v)
+{
+	unsigned int i;
+	unsigned int n = v->len;
+
+	switch (v->type) {
+	case FLAT_BOOLEAN:
+		lua_pushboolean(L, n);
+		return v + 1;
+	case FLAT_NUMBER:
+		lua_pushnumber(L, v->u.n);
+		return v + 1;
+	case FLAT_STRING:
+		lua_pushlstring(L, v->u.s, n);
+		return v + 1;
+	case FLAT_ARRAY:
+		lua_createtable(L, n, 0);
+		v++;
+		for (i = 1; i <= n; i++) {
+			v = flat_push_value(L, v);
+			lua_rawseti(L, -2, i);
+		}
+		return v;
+	case FLAT_DICT:
+		lua_createtable(L, 0, n);
+		v++;
+		for (i = 0; i < n; i++) {
+			v = flat_push_value(L, v);
+			v = flat_push_value(L, v);
+			lua_rawset(L, -3);
+		}
+		return v;
+	}
+
+	lua_pushnil(L);
+	return v + 1;
+}
+
+/*
+ * Push the arguments walked into f onto the stack of L,
+ * the sizes of all tables are known up front by now.
+ * Returns the number of arguments pushed.
+ */
+EXPORT int
+lem_dbus_flat_push(lua_State *L, struct flat *f)
+{
+	struct flat_value *v = f->values;
+	unsigned int i;
+
+	luaL_checkstack(L, f->argc, NULL);
+	for (i = 0; i < f->argc; i++)
+		v = flat_push_value(L, v);
+
+	return f->argc;
+}
+
+EXPORT void
+lem_dbus_flat_free(struct flat *f)
+{
+	free(f->values);
+	f->values = NULL;
+	f->n = 0;
+	f->size = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FLAT_H
+#define _FLAT_H
+
+/*
+ * The arguments of a message walked into a flat array of values,
+ * which can be done without touching Lua, and turned into Lua
+ * values later without touching libdbus. Strings point into the
+ * message, so it must be kept until the values are pushed.
+ */
+struct flat_value;
+
+struct flat {
+	struct flat_value *values;
+	unsigned int n;
+	unsigned int size;
+	unsigned int argc;
+};
+
+#ifndef AMALG
+size_t lem_dbus_flat_size(DBusMessage *msg);
+void lem_dbus_flat_walk(struct flat *f, DBusMessage *msg);
+int lem_dbus_flat_push(lua_State *L, struct flat *f);
+void lem_dbus_flat_free(struct flat *f);
+#endif
+
+#endif
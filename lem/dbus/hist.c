@@ -0,0 +1,307 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AMALG
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <lem.h>
+
+#include "hist.h"
+
+#define EXPORT
+#endif
+
+/*
+ * Histograms live in plain C memory, keyed by up to three strings
+ * (eg. destination, interface and member), so recording a sample
+ * never allocates anything once the key has been seen.
+ */
+struct hist_entry {
+	struct hist_entry *next;
+	unsigned int hash;
+	struct histogram h;
+	char key[];
+};
+
+static unsigned int
+hist_index(uint64_t us)
+{
+	int e;
+
+	if (us < HIST_LINEAR)
+		return (unsigned int)us;
+
+	e = 63 - __builtin_clzll(us);
+	if (e > 36)
+		return HIST_BUCKETS - 1;
+
+	return HIST_LINEAR + (unsigned int)(e - 5) * HIST_SUB
+		+ (unsigned int)(us >> (e - 4)) - HIST_SUB;
+}
+
+/* returns the middle of bucket i in seconds */
+static double
+hist_value(unsigned int i)
+{
+	unsigned int e;
+	uint64_t low;
+	uint64_t width;
+
+	if (i < HIST_LINEAR)
+		return (double)i / 1e6;
+
+	i -= HIST_LINEAR;
+	e = i / HIST_SUB + 5;
+	low = (uint64_t)(i % HIST_SUB + HIST_SUB) << (e - 4);
+	width = (uint64_t)1 << (e - 4);
+	return ((double)low + (double)(width - 1) / 2) / 1e6;
+}
+
+EXPORT void
+lem_dbus_hist_record(struct histogram *h, double seconds)
+{
+	if (seconds < 0)
+		seconds = 0;
+
+	if (h->count == 0 || seconds < h->min)
+		h->min = seconds;
+	if (seconds > h->max)
+		h->max = seconds;
+	h->count++;
+	h->sum += seconds;
+	h->buckets[hist_index((uint64_t)(seconds * 1e6))]++;
+}
+
+static double
+hist_percentile(struct histogram *h, double p)
+{
+	double want = (p / 100.0) * (double)h->count;
+	unsigned long seen = 0;
+	unsigned int i;
+	double v;
+
+	if (h->count == 0)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if ((double)seen >= want && seen > 0)
+			break;
+	}
+
+	v = hist_value(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+	if (v < h->min)
+		v = h->min;
+	if (v > h->max)
+		v = h->max;
+	return v;
+}
+
+static unsigned int
+hist_hash(const char *a, const char *b, const char *c)
+{
+	const char *parts[3] = { a, b, c };
+	unsigned int hash = 5381;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		const char *s = parts[i] ? parts[i] : "";
+
+		while (*s)
+			hash = hash * 33 + (unsigned char)*s++;
+		hash = hash * 33 + '\n';
+	}
+
+	return hash;
+}
+
+/* compare a stored "a\nb\nc" key with the parts */
+static int
+hist_match(const char *key, const char *a, const char *b, const char *c)
+{
+	const char *parts[3] = { a, b, c };
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		const char *s = parts[i] ? parts[i] : "";
+		size_t len = strlen(s);
+
+		if (strncmp(key, s, len))
+			return 0;
+		key += len;
+		if (*key != (i < 2 ? '\n' : '\0'))
+			return 0;
+		key++;
+	}
+
+	return 1;
+}
+
+static void
+hist_grow(struct hist_table *t)
+{
+	unsigned int size = t->size ? 2 * t->size : 16;
+	struct hist_entry **buckets = lem_xmalloc(size * sizeof(struct hist_entry *));
+	unsigned int i;
+
+	memset(buckets, 0, size * sizeof(struct hist_entry *));
+	for (i = 0; i < t->size; i++) {
+		struct hist_entry *e = t->buckets[i];
+
+		while (e) {
+			struct hist_entry *next = e->next;
+			unsigned int j = e->hash & (size - 1);
+
+			e->next = buckets[j];
+			buckets[j] = e;
+			e = next;
+		}
+	}
+
+	free(t->buckets);
+	t->buckets = buckets;
+	t->size = size;
+}
+
+/*
+ * Returns the histogram for the key a, b, c,
+ * creating it if it doesn't exist yet.
+ */
+EXPORT struct histogram *
+lem_dbus_hist_get(struct hist_table *t,
+                  const char *a, const char *b, const char *c)
+{
+	unsigned int hash = hist_hash(a, b, c);
+	struct hist_entry *e;
+	size_t len;
+
+	if (t->size > 0) {
+		for (e = t->buckets[hash & (t->size - 1)]; e; e = e->next) {
+			if (e->hash == hash && hist_match(e->key, a, b, c))
+				return &e->h;
+		}
+	}
+
+	if (t->count >= t->size)
+		hist_grow(t);
+
+	if (a == NULL)
+		a = "";
+	if (b == NULL)
+		b = "";
+	if (c == NULL)
+		c = "";
+	len = strlen(a) + strlen(b) + strlen(c) + 3;
+
+	e = lem_xmalloc(sizeof(struct hist_entry) + len);
+	memset(&e->h, 0, sizeof(struct histogram));
+	sprintf(e->key, "%s\n%s\n%s", a, b, c);
+	e->hash = hash;
+	e->next = t->buckets[hash & (t->size - 1)];
+	t->buckets[hash & (t->size - 1)] = e;
+	t->count++;
+
+	return &e->h;
+}
+
+/*
+ * Zeroes all histograms, but keeps them around
+ * since pending calls may still point to them.
+ */
+EXPORT void
+lem_dbus_hist_reset(struct hist_table *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->size; i++) {
+		struct hist_entry *e;
+
+		for (e = t->buckets[i]; e; e = e->next)
+			memset(&e->h, 0, sizeof(struct histogram));
+	}
+}
+
+EXPORT void
+lem_dbus_hist_free(struct hist_table *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->size; i++) {
+		struct hist_entry *e = t->buckets[i];
+
+		while (e) {
+			struct hist_entry *next = e->next;
+
+			free(e);
+			e = next;
+		}
+	}
+
+	free(t->buckets);
+	t->buckets = NULL;
+	t->size = 0;
+	t->count = 0;
+}
+
+static void
+hist_push_one(lua_State *L, struct histogram *h, int first, int last)
+{
+	int i;
+
+	lua_createtable(L, 0, 8);
+	lua_pushnumber(L, (lua_Number)h->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, h->min);
+	lua_setfield(L, -2, "min");
+	lua_pushnumber(L, h->max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, h->count ? h->sum / (double)h->count : 0);
+	lua_setfield(L, -2, "mean");
+
+	for (i = first; i <= last; i++) {
+		lua_pushvalue(L, i);
+		lua_pushnumber(L, hist_percentile(h, lua_tonumber(L, i)));
+		lua_rawset(L, -3);
+	}
+}
+
+/*
+ * Pushes a table mapping every key in t to a table with count,
+ * min, max and mean plus the percentiles given as numbers on the
+ * stack from index first, all in seconds.
+ */
+EXPORT void
+lem_dbus_hist_push(lua_State *L, struct hist_table *t, int first)
+{
+	int last = lua_gettop(L);
+	unsigned int i;
+
+	lua_createtable(L, 0, t->count);
+	for (i = 0; i < t->size; i++) {
+		struct hist_entry *e;
+
+		for (e = t->buckets[i]; e; e = e->next) {
+			if (e->h.count == 0)
+				continue;
+			lua_pushstring(L, e->key);
+			hist_push_one(L, &e->h, first, last);
+			lua_rawset(L, -3);
+		}
+	}
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear buckets of microseconds: values below 32 get a bucket
+ * each, above that every power of two is split into 16 buckets,
+ * so any value is off by at most 1/16 up to 2^36us (~19 hours).
+ */
+#define HIST_LINEAR  32
+#define HIST_SUB     16
+#define HIST_BUCKETS (HIST_LINEAR + (36 - 5 + 1) * HIST_SUB)
+
+struct histogram {
+	unsigned long count;
+	double sum;
+	double min;
+	double max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+struct hist_entry;
+
+struct hist_table {
+	struct hist_entry **buckets;
+	unsigned int size;
+	unsigned int count;
+};
+
+#ifndef AMALG
+void lem_dbus_hist_record(struct histogram *h, double seconds);
+struct histogram *lem_dbus_hist_get(struct hist_table *t,
+		const char *a, const char *b, const char *c);
+void lem_dbus_hist_reset(struct hist_table *t);
+void lem_dbus_hist_free(struct hist_table *t);
+void lem_dbus_hist_push(lua_State *L, struct hist_table *t, int first);
+#endif
+
+#endif
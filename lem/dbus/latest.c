@@ -0,0 +1,376 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AMALG
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <lem.h>
+#include <dbus/dbus.h>
+
+#include "push.h"
+#include "latest.h"
+
+#define EXPORT
+#endif
+
+#define LEM_DBUS_LATEST_META "lem.dbus.Latest"
+
+/*
+ * A signal handler for signals arriving faster than they can be
+ * handled. Signals wait here undecoded until the handler asks for
+ * the next one, and a newer signal replaces the one waiting in the
+ * same slot, so the handler always gets the most recent state.
+ * Without a key there is a single slot. Otherwise the slots are
+ * keyed by the value of one argument, and handed out in the order
+ * their keys first arrived. Once all slots are taken signals with
+ * new keys are dropped.
+ */
+struct latest_slot {
+	DBusMessage *msg;
+	char *key;
+	unsigned long dropped;
+};
+
+struct latest {
+	lua_State *T; /* thread waiting in Latest:next() */
+	int key;      /* argument to coalesce by, or -1 */
+	int closed;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	unsigned long received;
+	unsigned long dropped;
+	struct latest_slot *slots;
+};
+
+/*
+ * Return the Latest object at index, or NULL if there is none.
+ */
+EXPORT struct latest *
+lem_dbus_latest_get(lua_State *L, int index)
+{
+	struct latest *l = lua_touserdata(L, index);
+
+	if (l == NULL || !lua_getmetatable(L, index))
+		return NULL;
+
+	luaL_getmetatable(L, LEM_DBUS_LATEST_META);
+	if (!lua_rawequal(L, -1, -2))
+		l = NULL;
+	lua_pop(L, 2);
+
+	return l;
+}
+
+/*
+ * Write the value of argument index of msg to buf as a string.
+ * Arguments which aren't there or aren't basic types give "".
+ */
+static const char *
+latest_key(DBusMessage *msg, int index, char *buf, size_t len)
+{
+	DBusMessageIter iter;
+	DBusBasicValue v;
+	int type;
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return "";
+	while (index-- > 0) {
+		if (!dbus_message_iter_next(&iter))
+			return "";
+	}
+
+	type = dbus_message_iter_get_arg_type(&iter);
+	if (!dbus_type_is_basic(type) || type == DBUS_TYPE_UNIX_FD)
+		return "";
+
+	dbus_message_iter_get_basic(&iter, &v);
+	switch (type) {
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	case DBUS_TYPE_SIGNATURE:
+		return v.str;
+	case DBUS_TYPE_BOOLEAN:
+		return v.bool_val ? "true" : "false";
+	case DBUS_TYPE_BYTE:
+		(void)snprintf(buf, len, "%u", (unsigned int)v.byt);
+		break;
+	case DBUS_TYPE_INT16:
+		(void)snprintf(buf, len, "%d", (int)v.i16);
+		break;
+	case DBUS_TYPE_UINT16:
+		(void)snprintf(buf, len, "%u", (unsigned int)v.u16);
+		break;
+	case DBUS_TYPE_INT32:
+		(void)snprintf(buf, len, "%ld", (long)v.i32);
+		break;
+	case DBUS_TYPE_UINT32:
+		(void)snprintf(buf, len, "%lu", (unsigned long)v.u32);
+		break;
+	case DBUS_TYPE_INT64:
+		(void)snprintf(buf, len, "%lld", (long long)v.i64);
+		break;
+	case DBUS_TYPE_UINT64:
+		(void)snprintf(buf, len, "%llu", (unsigned long long)v.u64);
+		break;
+	case DBUS_TYPE_DOUBLE:
+		(void)snprintf(buf, len, "%.17g", v.dbl);
+		break;
+	default:
+		return "";
+	}
+
+	return buf;
+}
+
+/*
+ * Hand msg to the thread waiting for it, or put it
+ * in its slot replacing whatever was there.
+ */
+EXPORT void
+lem_dbus_latest_push(struct latest *l, DBusMessage *msg)
+{
+	struct latest_slot *s;
+	const char *key = NULL;
+	char buf[32];
+	unsigned int i;
+
+	if (l->closed)
+		return;
+
+	l->received++;
+
+	if (l->T) {
+		lua_State *T = l->T;
+
+		l->T = NULL;
+		lua_pushnumber(T, 0);
+		lem_queue(T, lem_dbus_push_arguments(T, msg) + 1);
+		return;
+	}
+
+	if (l->key >= 0)
+		key = latest_key(msg, l->key, buf, sizeof(buf));
+
+	for (i = 0; i < l->count; i++) {
+		s = &l->slots[(l->head + i) % l->size];
+		if (key == NULL || strcmp(s->key, key) == 0) {
+			dbus_message_unref(s->msg);
+			s->msg = dbus_message_ref(msg);
+			s->dropped++;
+			l->dropped++;
+			return;
+		}
+	}
+
+	if (l->count == l->size) {
+		l->dropped++;
+		return;
+	}
+
+	s = &l->slots[(l->head + l->count) % l->size];
+	s->msg = dbus_message_ref(msg);
+	s->key = NULL;
+	if (key) {
+		size_t len = strlen(key) + 1;
+
+		s->key = lem_xmalloc(len);
+		memcpy(s->key, key, len);
+	}
+	s->dropped = 0;
+	l->count++;
+}
+
+static void
+latest_clear(struct latest *l)
+{
+	while (l->count > 0) {
+		struct latest_slot *s = &l->slots[l->head];
+
+		dbus_message_unref(s->msg);
+		free(s->key);
+		l->head = (l->head + 1) % l->size;
+		l->count--;
+	}
+}
+
+static int
+latest_gc(lua_State *T)
+{
+	struct latest *l = lua_touserdata(T, 1);
+
+	latest_clear(l);
+	free(l->slots);
+	l->slots = NULL;
+	l->closed = 1;
+	return 0;
+}
+
+/*
+ * Latest:next()
+ *
+ * Waits for a signal if none is waiting already. Returns the
+ * number of signals it replaced followed by its arguments,
+ * or nil once the Latest object is closed.
+ */
+static int
+latest_next(lua_State *T)
+{
+	struct latest *l = luaL_checkudata(T, 1, LEM_DBUS_LATEST_META);
+	struct latest_slot *s;
+	int nargs;
+
+	if (l->closed) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (l->T) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	if (l->count == 0) {
+		l->T = T;
+		lua_settop(T, 0);
+		return lua_yield(T, 0);
+	}
+
+	s = &l->slots[l->head];
+	l->head = (l->head + 1) % l->size;
+	l->count--;
+
+	lua_pushnumber(T, (lua_Number)s->dropped);
+	nargs = lem_dbus_push_arguments(T, s->msg);
+	dbus_message_unref(s->msg);
+	free(s->key);
+	return nargs + 1;
+}
+
+/*
+ * Latest:close()
+ *
+ * Drops any waiting signals and wakes
+ * up the thread waiting in Latest:next().
+ */
+static int
+latest_close(lua_State *T)
+{
+	struct latest *l = luaL_checkudata(T, 1, LEM_DBUS_LATEST_META);
+
+	if (l->closed) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "already closed");
+		return 2;
+	}
+
+	l->closed = 1;
+	latest_clear(l);
+	if (l->T) {
+		lua_State *S = l->T;
+
+		l->T = NULL;
+		lua_pushnil(S);
+		lua_pushliteral(S, "closed");
+		lem_queue(S, 2);
+	}
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Latest:stats()
+ *
+ * Returns a table with the number of signals received,
+ * dropped and waiting to be handled.
+ */
+static int
+latest_stats(lua_State *T)
+{
+	struct latest *l = luaL_checkudata(T, 1, LEM_DBUS_LATEST_META);
+
+	lua_createtable(T, 0, 3);
+	lua_pushnumber(T, (lua_Number)l->received);
+	lua_setfield(T, -2, "received");
+	lua_pushnumber(T, (lua_Number)l->dropped);
+	lua_setfield(T, -2, "dropped");
+	lua_pushnumber(T, (lua_Number)l->count);
+	lua_setfield(T, -2, "waiting");
+	return 1;
+}
+
+/*
+ * newlatest()
+ *
+ * argument 1: index of the argument to coalesce by,
+ *             counting from 0 like argN rules (optional)
+ * argument 2: number of keys to keep (optional, default 64)
+ */
+EXPORT int
+lem_dbus_latest_new(lua_State *T)
+{
+	int key = (int)luaL_optinteger(T, 1, -1);
+	lua_Integer size = luaL_optinteger(T, 2, 64);
+	struct latest *l;
+
+	luaL_argcheck(T, key >= -1 && key < 64, 1, "invalid argument index");
+	luaL_argcheck(T, size > 0, 2, "must be positive");
+	if (key < 0)
+		size = 1;
+
+	l = lua_newuserdata(T, sizeof(struct latest));
+	l->T = NULL;
+	l->key = key;
+	l->closed = 0;
+	l->size = (unsigned int)size;
+	l->head = 0;
+	l->count = 0;
+	l->received = 0;
+	l->dropped = 0;
+	l->slots = lem_xmalloc(size * sizeof(struct latest_slot));
+
+	luaL_getmetatable(T, LEM_DBUS_LATEST_META);
+	lua_setmetatable(T, -2);
+	return 1;
+}
+
+EXPORT void
+lem_dbus_latest_open(lua_State *L)
+{
+	luaL_newmetatable(L, LEM_DBUS_LATEST_META);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, latest_gc);
+	lua_setfield(L, -2, "__gc");
+
+	lua_pushcfunction(L, latest_next);
+	lua_setfield(L, -2, "next");
+
+	lua_pushcfunction(L, latest_close);
+	lua_setfield(L, -2, "close");
+
+	lua_pushcfunction(L, latest_stats);
+	lua_setfield(L, -2, "stats");
+}
@@ -0,0 +1,276 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AMALG
+#include <stdlib.h>
+#include <string.h>
+#include <lem.h>
+
+#include "limit.h"
+
+#define EXPORT
+#endif
+
+#define LEM_DBUS_LIMIT_META "lem.dbus.Limit"
+
+/*
+ * Return the limit at index, or NULL if there is none.
+ */
+EXPORT struct limit *
+lem_dbus_limit_get(lua_State *L, int index)
+{
+	struct limit *l = lua_touserdata(L, index);
+
+	if (l == NULL || !lua_getmetatable(L, index))
+		return NULL;
+
+	luaL_getmetatable(L, LEM_DBUS_LIMIT_META);
+	if (!lua_rawequal(L, -1, -2))
+		l = NULL;
+	lua_pop(L, 2);
+
+	return l;
+}
+
+static struct limit_sender *
+limit_sender_find(struct limit *l, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < l->nsenders; i++) {
+		if (strcmp(l->senders[i].name, name) == 0)
+			return &l->senders[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Return true if a call from sender would have
+ * to be shed rather than wait for a slot.
+ */
+EXPORT int
+lem_dbus_limit_full(struct limit *l, const char *sender)
+{
+	struct limit_sender *s;
+
+	if (l->count == l->size)
+		return 1;
+
+	s = limit_sender_find(l, sender ? sender : "");
+	return s && s->count >= l->persender;
+}
+
+/*
+ * Put the thread T at the end of the wait queue of sender.
+ * Returns 0 if there is no room for it.
+ */
+EXPORT int
+lem_dbus_limit_push(struct limit *l, const char *sender,
+                    lua_State *T, void *data, int nargs)
+{
+	struct limit_sender *s;
+	struct limit_waiter *w;
+	unsigned int i;
+
+	if (sender == NULL)
+		sender = "";
+
+	if (lem_dbus_limit_full(l, sender))
+		return 0;
+
+	i = l->free;
+	w = &l->queue[i];
+	l->free = w->next;
+	w->T = T;
+	w->data = data;
+	w->nargs = nargs;
+	w->next = l->size;
+
+	s = limit_sender_find(l, sender);
+	if (s == NULL) {
+		size_t len = strlen(sender) + 1;
+
+		/* there can be no more senders than waiting calls */
+		s = &l->senders[l->nsenders++];
+		s->name = lem_xmalloc(len);
+		memcpy(s->name, sender, len);
+		s->head = i;
+		s->count = 0;
+	} else
+		l->queue[s->tail].next = i;
+	s->tail = i;
+	s->count++;
+
+	l->count++;
+	l->queued++;
+	return 1;
+}
+
+/*
+ * Take the first thread out of the wait queue of the sender
+ * whose turn it is. Returns NULL if nothing is waiting.
+ */
+EXPORT lua_State *
+lem_dbus_limit_shift(struct limit *l, void **data, int *nargs)
+{
+	struct limit_sender *s;
+	struct limit_waiter *w;
+	unsigned int i;
+
+	if (l->count == 0)
+		return NULL;
+
+	if (l->turn >= l->nsenders)
+		l->turn = 0;
+	s = &l->senders[l->turn];
+
+	i = s->head;
+	w = &l->queue[i];
+	s->head = w->next;
+	s->count--;
+	l->count--;
+
+	if (s->count == 0) {
+		/* the sender leaves the rotation,
+		 * the next one moves up to its turn */
+		free(s->name);
+		l->nsenders--;
+		memmove(s, s + 1, (l->nsenders - l->turn) *
+		                  sizeof(struct limit_sender));
+	} else
+		l->turn++;
+
+	w->next = l->free;
+	l->free = i;
+
+	*data = w->data;
+	*nargs = w->nargs;
+	return w->T;
+}
+
+static int
+limit_gc(lua_State *T)
+{
+	struct limit *l = lua_touserdata(T, 1);
+
+	/* waiting threads hold on to the limit,
+	 * so the queue is always empty here */
+	free(l->queue);
+	l->queue = NULL;
+	free(l->senders);
+	l->senders = NULL;
+	return 0;
+}
+
+/*
+ * Limit:stats()
+ *
+ * Returns a table with the number of calls being handled,
+ * waiting in the queue, the number of senders waiting and the
+ * counters of calls handled, queued and shed since the limit
+ * was created.
+ */
+static int
+limit_stats(lua_State *T)
+{
+	struct limit *l = luaL_checkudata(T, 1, LEM_DBUS_LIMIT_META);
+
+	lua_createtable(T, 0, 9);
+	lua_pushnumber(T, (lua_Number)l->max);
+	lua_setfield(T, -2, "max");
+	lua_pushnumber(T, (lua_Number)l->size);
+	lua_setfield(T, -2, "queue");
+	lua_pushnumber(T, (lua_Number)l->persender);
+	lua_setfield(T, -2, "persender");
+	lua_pushnumber(T, (lua_Number)l->active);
+	lua_setfield(T, -2, "active");
+	lua_pushnumber(T, (lua_Number)l->count);
+	lua_setfield(T, -2, "waiting");
+	lua_pushnumber(T, (lua_Number)l->nsenders);
+	lua_setfield(T, -2, "senders");
+	lua_pushnumber(T, (lua_Number)l->handled);
+	lua_setfield(T, -2, "handled");
+	lua_pushnumber(T, (lua_Number)l->queued);
+	lua_setfield(T, -2, "queued");
+	lua_pushnumber(T, (lua_Number)l->shed);
+	lua_setfield(T, -2, "shed");
+	return 1;
+}
+
+/*
+ * newlimit()
+ *
+ * argument 1: calls handled at once
+ * argument 2: calls waiting for a slot (optional, default 0)
+ * argument 3: calls waiting from a single sender (optional)
+ */
+EXPORT int
+lem_dbus_limit_new(lua_State *T)
+{
+	lua_Integer max = luaL_checkinteger(T, 1);
+	lua_Integer size = luaL_optinteger(T, 2, 0);
+	lua_Integer persender = luaL_optinteger(T, 3, size);
+	struct limit *l;
+	unsigned int i;
+
+	luaL_argcheck(T, max > 0, 1, "must be positive");
+	luaL_argcheck(T, size >= 0, 2, "must not be negative");
+	luaL_argcheck(T, persender > 0 || size == 0, 3, "must be positive");
+
+	l = lua_newuserdata(T, sizeof(struct limit));
+	l->max = (unsigned int)max;
+	l->active = 0;
+	l->size = (unsigned int)size;
+	l->persender = (unsigned int)persender;
+	l->count = 0;
+	l->free = 0;
+	l->nsenders = 0;
+	l->turn = 0;
+	l->handled = 0;
+	l->queued = 0;
+	l->shed = 0;
+	l->queue = NULL;
+	l->senders = NULL;
+	if (size > 0) {
+		l->queue = lem_xmalloc(size * sizeof(struct limit_waiter));
+		l->senders = lem_xmalloc(size * sizeof(struct limit_sender));
+		for (i = 0; i < l->size; i++)
+			l->queue[i].next = i + 1;
+	}
+
+	luaL_getmetatable(T, LEM_DBUS_LIMIT_META);
+	lua_setmetatable(T, -2);
+	return 1;
+}
+
+EXPORT void
+lem_dbus_limit_open(lua_State *L)
+{
+	luaL_newmetatable(L, LEM_DBUS_LIMIT_META);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, limit_gc);
+	lua_setfield(L, -2, "__gc");
+
+	lua_pushcfunction(L, limit_stats);
+	lua_setfield(L, -2, "stats");
+}
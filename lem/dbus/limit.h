@@ -0,0 +1,73 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LIMIT_H
+#define _LIMIT_H
+
+/*
+ * A concurrency limit on the method calls handled by an object,
+ * or by a single method. At most max calls are handled at once,
+ * up to size more wait for a slot and any further calls are
+ * answered with a LimitsExceeded error right away.
+ *
+ * Waiting calls are queued per sender and the senders take turns
+ * when a slot frees up, so a single client flooding the service
+ * only ever waits behind itself.
+ */
+struct limit_waiter {
+	lua_State *T;
+	void *data;
+	int nargs;
+	unsigned int next;
+};
+
+struct limit_sender {
+	char *name;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int count;
+};
+
+struct limit {
+	unsigned int max;
+	unsigned int active;
+	unsigned int size;
+	unsigned int persender;
+	unsigned int count;
+	unsigned int free;
+	unsigned int nsenders;
+	unsigned int turn;
+	unsigned long handled;
+	unsigned long queued;
+	unsigned long shed;
+	struct limit_waiter *queue;
+	struct limit_sender *senders;
+};
+
+#ifndef AMALG
+struct limit *lem_dbus_limit_get(lua_State *L, int index);
+int lem_dbus_limit_full(struct limit *l, const char *sender);
+int lem_dbus_limit_push(struct limit *l, const char *sender,
+                        lua_State *T, void *data, int nargs);
+lua_State *lem_dbus_limit_shift(struct limit *l, void **data, int *nargs);
+int lem_dbus_limit_new(lua_State *L);
+void lem_dbus_limit_open(lua_State *L);
+#endif
+
+#endif
@@ -0,0 +1,397 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AMALG
+#include <stdlib.h>
+#include <string.h>
+#include <lem.h>
+#include <dbus/dbus.h>
+
+#include "match.h"
+
+#define EXPORT
+#endif
+
+#if !(LUA_VERSION_NUM >= 502)
+#define lua_getuservalue lua_getfenv
+#define lua_setuservalue lua_setfenv
+#endif
+
+#define LEM_DBUS_MATCH_META "lem.dbus.Match"
+
+/*
+ * A signal handler which is only called for signals matching
+ * the sender and argN rules given, so signals which don't match
+ * are dropped before any arguments are decoded. The rules mean
+ * the same as in a D-Bus match rule.
+ */
+enum {
+	MATCH_ARG,
+	MATCH_PATH,
+	MATCH_NAMESPACE
+};
+
+struct match_arg {
+	unsigned int index;
+	int type;
+	char *value;
+};
+
+struct match {
+	char *sender;
+	char *owner; /* unique name of a well-known sender */
+	int resolved; /* set when the owner above is known */
+	unsigned int nargs;
+	struct match_arg args[];
+};
+
+#define MATCH_MAXARGS 64
+
+static char *
+match_strdup(const char *s, size_t len)
+{
+	char *r = lem_xmalloc(len + 1);
+
+	memcpy(r, s, len + 1);
+	return r;
+}
+
+/*
+ * Return the Match object at index, or NULL if there is none.
+ */
+EXPORT struct match *
+lem_dbus_match_get(lua_State *L, int index)
+{
+	struct match *m = lua_touserdata(L, index);
+
+	if (m == NULL || !lua_getmetatable(L, index))
+		return NULL;
+
+	luaL_getmetatable(L, LEM_DBUS_MATCH_META);
+	if (!lua_rawequal(L, -1, -2))
+		m = NULL;
+	lua_pop(L, 2);
+
+	return m;
+}
+
+static int
+match_path(const char *arg, const char *value)
+{
+	size_t a = strlen(arg);
+	size_t v = strlen(value);
+
+	if (a == v)
+		return strcmp(arg, value) == 0;
+
+	/* either one is a parent directory of the other */
+	if (a < v)
+		return a > 0 && arg[a-1] == '/' && strncmp(arg, value, a) == 0;
+
+	return v > 0 && value[v-1] == '/' && strncmp(arg, value, v) == 0;
+}
+
+static int
+match_namespace(const char *arg, const char *value)
+{
+	size_t v = strlen(value);
+
+	return strncmp(arg, value, v) == 0 &&
+	       (arg[v] == '\0' || arg[v] == '.');
+}
+
+/*
+ * Return true if msg passes every rule of m.
+ */
+EXPORT int
+lem_dbus_match_test(struct match *m, DBusMessage *msg)
+{
+	DBusMessageIter iter;
+	unsigned int index = 0;
+	unsigned int i;
+
+	/* well-known names are resolved by the bus daemon,
+	 * here only the unique name of the sender is known,
+	 * or the owner of the name if it is being tracked */
+	if (m->sender) {
+		const char *sender = m->sender;
+
+		if (sender[0] != ':')
+			sender = m->resolved ? m->owner : NULL;
+		if (m->resolved && sender == NULL)
+			return 0;
+		if (sender) {
+			const char *from = dbus_message_get_sender(msg);
+
+			if (from == NULL || strcmp(from, sender) != 0)
+				return 0;
+		}
+	}
+
+	if (m->nargs == 0)
+		return 1;
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return 0;
+
+	/* the rules are sorted by argument index */
+	for (i = 0; i < m->nargs; i++) {
+		struct match_arg *a = &m->args[i];
+		const char *arg;
+		int type;
+
+		while (index < a->index) {
+			if (!dbus_message_iter_next(&iter))
+				return 0;
+			index++;
+		}
+
+		type = dbus_message_iter_get_arg_type(&iter);
+		if (type != DBUS_TYPE_STRING &&
+		    !(a->type == MATCH_PATH && type == DBUS_TYPE_OBJECT_PATH))
+			return 0;
+
+		dbus_message_iter_get_basic(&iter, &arg);
+		switch (a->type) {
+		case MATCH_ARG:
+			if (strcmp(arg, a->value) != 0)
+				return 0;
+			break;
+		case MATCH_PATH:
+			if (!match_path(arg, a->value))
+				return 0;
+			break;
+		case MATCH_NAMESPACE:
+			if (!match_namespace(arg, a->value))
+				return 0;
+			break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Push the handler of the Match object at index.
+ */
+EXPORT void
+lem_dbus_match_push_handler(lua_State *L, int index)
+{
+	lua_getuservalue(L, index);
+	lua_rawgeti(L, -1, 1);
+	lua_remove(L, -2);
+}
+
+static int
+match_gc(lua_State *T)
+{
+	struct match *m = lua_touserdata(T, 1);
+	unsigned int i;
+
+	free(m->sender);
+	m->sender = NULL;
+	free(m->owner);
+	m->owner = NULL;
+	for (i = 0; i < m->nargs; i++) {
+		free(m->args[i].value);
+		m->args[i].value = NULL;
+	}
+	m->nargs = 0;
+	return 0;
+}
+
+/*
+ * Match:handler()
+ *
+ * Returns the handler and the rules the match was created with.
+ */
+static int
+match_handler(lua_State *T)
+{
+	luaL_checkudata(T, 1, LEM_DBUS_MATCH_META);
+	lua_getuservalue(T, 1);
+	lua_rawgeti(T, -1, 1);
+	lua_rawgeti(T, -2, 2);
+	return 2;
+}
+
+/*
+ * Match:setowner()
+ *
+ * argument 1: match object
+ * argument 2: unique name, false or nil
+ *
+ * Tells the match who currently owns the well-known name of its
+ * sender rule, so signals from anyone else are dropped here rather
+ * than relying on the bus daemon alone. False means the name has
+ * no owner and nil that the owner isn't known.
+ */
+static int
+match_setowner(lua_State *T)
+{
+	struct match *m = luaL_checkudata(T, 1, LEM_DBUS_MATCH_META);
+	char *owner = NULL;
+	int resolved = 1;
+
+	if (lua_isnoneornil(T, 2))
+		resolved = 0;
+	else if (lua_type(T, 2) == LUA_TSTRING) {
+		size_t len;
+		const char *name = lua_tolstring(T, 2, &len);
+
+		owner = match_strdup(name, len);
+	} else if (lua_type(T, 2) != LUA_TBOOLEAN || lua_toboolean(T, 2))
+		return luaL_argerror(T, 2, "expected a name, false or nil");
+
+	free(m->owner);
+	m->owner = owner;
+	m->resolved = resolved;
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Parse a rule name like arg3 or arg0namespace.
+ * Returns 0 if it isn't an argN rule.
+ */
+static int
+match_parse_arg(const char *key, struct match_arg *a)
+{
+	unsigned int index = 0;
+	const char *p;
+
+	if (strncmp(key, "arg", 3) != 0)
+		return 0;
+
+	p = key + 3;
+	if (*p < '0' || *p > '9')
+		return 0;
+	do {
+		index = 10 * index + (unsigned int)(*p++ - '0');
+		if (index >= MATCH_MAXARGS)
+			return 0;
+	} while (*p >= '0' && *p <= '9');
+
+	if (*p == '\0')
+		a->type = MATCH_ARG;
+	else if (strcmp(p, "path") == 0)
+		a->type = MATCH_PATH;
+	else if (strcmp(p, "namespace") == 0)
+		a->type = MATCH_NAMESPACE;
+	else
+		return 0;
+
+	a->index = index;
+	return 1;
+}
+
+/*
+ * newmatch()
+ *
+ * argument 1: table of rules (sender, argN, argNpath, argNnamespace)
+ * argument 2: handler (function or Latest object)
+ */
+EXPORT int
+lem_dbus_match_new(lua_State *T)
+{
+	struct match *m;
+	unsigned int n = 0;
+
+	luaL_checktype(T, 1, LUA_TTABLE);
+	if (lua_type(T, 2) != LUA_TFUNCTION && lua_type(T, 2) != LUA_TUSERDATA)
+		return luaL_argerror(T, 2, "expected a handler");
+
+	/* count the argN rules first */
+	lua_pushnil(T);
+	while (lua_next(T, 1)) {
+		struct match_arg a;
+		const char *key;
+
+		lua_pop(T, 1);
+		if (lua_type(T, -1) != LUA_TSTRING)
+			return luaL_argerror(T, 1, "rule names must be strings");
+		key = lua_tostring(T, -1);
+		if (match_parse_arg(key, &a))
+			n++;
+		else if (strcmp(key, "sender") != 0)
+			return luaL_error(T, "unknown match rule '%s'", key);
+	}
+
+	m = lua_newuserdata(T, sizeof(struct match) +
+	                       n * sizeof(struct match_arg));
+	m->sender = NULL;
+	m->owner = NULL;
+	m->resolved = 0;
+	m->nargs = 0;
+
+	luaL_getmetatable(T, LEM_DBUS_MATCH_META);
+	lua_setmetatable(T, -2);
+
+	lua_pushnil(T);
+	while (lua_next(T, 1)) {
+		const char *key = lua_tostring(T, -2);
+		const char *value;
+		size_t len;
+		struct match_arg a;
+		unsigned int i;
+
+		if (lua_type(T, -1) != LUA_TSTRING)
+			return luaL_error(T, "match rule '%s' must be a string", key);
+		value = lua_tolstring(T, -1, &len);
+		lua_pop(T, 1);
+
+		if (!match_parse_arg(key, &a)) {
+			m->sender = match_strdup(value, len);
+			continue;
+		}
+
+		/* keep the rules sorted by argument index */
+		for (i = m->nargs; i > 0 && m->args[i-1].index > a.index; i--)
+			m->args[i] = m->args[i-1];
+		a.value = match_strdup(value, len);
+		m->args[i] = a;
+		m->nargs++;
+	}
+
+	lua_createtable(T, 2, 0);
+	lua_pushvalue(T, 2);
+	lua_rawseti(T, -2, 1);
+	lua_pushvalue(T, 1);
+	lua_rawseti(T, -2, 2);
+	lua_setuservalue(T, -2);
+	return 1;
+}
+
+EXPORT void
+lem_dbus_match_open(lua_State *L)
+{
+	luaL_newmetatable(L, LEM_DBUS_MATCH_META);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, match_gc);
+	lua_setfield(L, -2, "__gc");
+
+	lua_pushcfunction(L, match_handler);
+	lua_setfield(L, -2, "handler");
+
+	lua_pushcfunction(L, match_setowner);
+	lua_setfield(L, -2, "setowner");
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MATCH_H
+#define _MATCH_H
+
+struct match;
+
+#ifndef AMALG
+struct match *lem_dbus_match_get(lua_State *L, int index);
+int lem_dbus_match_test(struct match *m, DBusMessage *msg);
+void lem_dbus_match_push_handler(lua_State *L, int index);
+int lem_dbus_match_new(lua_State *L);
+void lem_dbus_match_open(lua_State *L);
+#endif
+
+#endif
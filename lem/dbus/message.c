@@ -0,0 +1,269 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AMALG
+#include <lem.h>
+#include <dbus/dbus.h>
+
+#include "push.h"
+
+#define EXPORT
+#endif
+
+#define LEM_DBUS_MESSAGE_HANDLE "lem.dbus.Message"
+
+/*
+ * Message objects hold a reference to a libdbus message
+ * so its header can be inspected and its arguments decoded
+ * only when, and if, they are needed. Messages received by
+ * raw handlers also remember the connection they came from,
+ * so replies can be sent back on it.
+ */
+struct msg_handle {
+	DBusMessage *msg;
+	DBusConnection *conn;
+};
+
+static DBusMessage *
+msg_check(lua_State *T)
+{
+	struct msg_handle *h = luaL_checkudata(T, 1, LEM_DBUS_MESSAGE_HANDLE);
+
+	if (h->msg == NULL)
+		luaL_argerror(T, 1, "message already sent");
+
+	return h->msg;
+}
+
+static int
+msg_pushstring(lua_State *T, const char *s)
+{
+	if (s == NULL)
+		lua_pushnil(T);
+	else
+		lua_pushstring(T, s);
+	return 1;
+}
+
+/*
+ * Message:__gc()
+ */
+static int
+msg_gc(lua_State *T)
+{
+	struct msg_handle *h = lua_touserdata(T, 1);
+
+	if (h->msg) {
+		dbus_message_unref(h->msg);
+		h->msg = NULL;
+	}
+	if (h->conn) {
+		dbus_connection_unref(h->conn);
+		h->conn = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Message:type()
+ *
+ * Returns 'method_call', 'method_return', 'error' or 'signal'.
+ */
+static int
+msg_type(lua_State *T)
+{
+	return msg_pushstring(T,
+		dbus_message_type_to_string(dbus_message_get_type(msg_check(T))));
+}
+
+static int
+msg_serial(lua_State *T)
+{
+	lua_pushnumber(T, (lua_Number)dbus_message_get_serial(msg_check(T)));
+	return 1;
+}
+
+static int
+msg_replyserial(lua_State *T)
+{
+	lua_pushnumber(T,
+		(lua_Number)dbus_message_get_reply_serial(msg_check(T)));
+	return 1;
+}
+
+static int
+msg_sender(lua_State *T)
+{
+	return msg_pushstring(T, dbus_message_get_sender(msg_check(T)));
+}
+
+static int
+msg_destination(lua_State *T)
+{
+	return msg_pushstring(T, dbus_message_get_destination(msg_check(T)));
+}
+
+static int
+msg_path(lua_State *T)
+{
+	return msg_pushstring(T, dbus_message_get_path(msg_check(T)));
+}
+
+static int
+msg_interface(lua_State *T)
+{
+	return msg_pushstring(T, dbus_message_get_interface(msg_check(T)));
+}
+
+static int
+msg_member(lua_State *T)
+{
+	return msg_pushstring(T, dbus_message_get_member(msg_check(T)));
+}
+
+static int
+msg_errorname(lua_State *T)
+{
+	return msg_pushstring(T, dbus_message_get_error_name(msg_check(T)));
+}
+
+static int
+msg_signature(lua_State *T)
+{
+	return msg_pushstring(T, dbus_message_get_signature(msg_check(T)));
+}
+
+/*
+ * Message:args()
+ *
+ * Decodes and returns the arguments of the message.
+ */
+static int
+msg_args(lua_State *T)
+{
+	DBusMessage *msg = msg_check(T);
+
+	/* keep the message object on the stack while decoding */
+	lua_settop(T, 1);
+	return lem_dbus_push_arguments(T, msg);
+}
+
+/*
+ * Message:bytes()
+ *
+ * Returns the message in wire format.
+ */
+static int
+msg_bytes(lua_State *T)
+{
+	DBusMessage *msg = msg_check(T);
+	char *data;
+	int len;
+
+	if (!dbus_message_marshal(msg, &data, &len)) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	lua_pushlstring(T, data, len);
+	dbus_free(data);
+	return 1;
+}
+
+/*
+ * Push a new Message object holding a reference to msg,
+ * and to the connection conn it came from unless NULL.
+ */
+EXPORT void
+lem_dbus_message_push(lua_State *L, DBusMessage *msg, DBusConnection *conn)
+{
+	struct msg_handle *h = lua_newuserdata(L, sizeof(struct msg_handle));
+
+	h->msg = dbus_message_ref(msg);
+	h->conn = conn ? dbus_connection_ref(conn) : NULL;
+	luaL_getmetatable(L, LEM_DBUS_MESSAGE_HANDLE);
+	lua_setmetatable(L, -2);
+}
+
+/*
+ * Returns the message of the Message object at index,
+ * raising an error if there is none.
+ */
+EXPORT DBusMessage *
+lem_dbus_message_get(lua_State *L, int index)
+{
+	struct msg_handle *h = luaL_checkudata(L, index,
+	                                       LEM_DBUS_MESSAGE_HANDLE);
+
+	if (h->msg == NULL)
+		luaL_argerror(L, index, "message already sent");
+
+	return h->msg;
+}
+
+/*
+ * Returns the connection the Message object at index
+ * was received on, or NULL if it is not known.
+ */
+EXPORT DBusConnection *
+lem_dbus_message_conn(lua_State *L, int index)
+{
+	struct msg_handle *h = luaL_checkudata(L, index,
+	                                       LEM_DBUS_MESSAGE_HANDLE);
+
+	return h->conn;
+}
+
+/*
+ * Creates the Message metatable, registers it and leaves
+ * it on top of the stack. Message:error() is added by the
+ * core module, as replies are sent through the bus.
+ */
+EXPORT void
+lem_dbus_message_open(lua_State *L)
+{
+	luaL_Reg msg_funcs[] = {
+		{ "__gc",        msg_gc },
+		{ "type",        msg_type },
+		{ "serial",      msg_serial },
+		{ "replyserial", msg_replyserial },
+		{ "sender",      msg_sender },
+		{ "destination", msg_destination },
+		{ "path",        msg_path },
+		{ "interface",   msg_interface },
+		{ "member",      msg_member },
+		{ "errorname",   msg_errorname },
+		{ "signature",   msg_signature },
+		{ "args",        msg_args },
+		{ "bytes",       msg_bytes },
+		{ NULL,          NULL }
+	};
+	luaL_Reg *p;
+
+	luaL_newmetatable(L, LEM_DBUS_MESSAGE_HANDLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	for (p = msg_funcs; p->name; p++) {
+		lua_pushcfunction(L, p->func);
+		lua_setfield(L, -2, p->name);
+	}
+}
@@ -20,6 +20,8 @@
 #include <lem.h>
 #include <dbus/dbus.h>
 
+#include "fd.h"
+
 #define EXPORT
 #endif
 
@@ -107,6 +109,14 @@ push_string(lua_State *L, DBusMessageIter *args)
 	lua_pushstring(L, s);
 }
 
+static void
+push_unix_fd(lua_State *L, DBusMessageIter *args)
+{
+	int fd;
+	dbus_message_iter_get_basic(args, &fd);
+	lem_dbus_fd_push(L, fd);
+}
+
 static void
 push_variant(lua_State *L, DBusMessageIter *args)
 {
@@ -233,6 +243,8 @@ get_pushfunc(DBusMessageIter *args)
 	case DBUS_TYPE_OBJECT_PATH:
 	case DBUS_TYPE_SIGNATURE:
 		return push_string;
+	case DBUS_TYPE_UNIX_FD:
+		return push_unix_fd;
 	case DBUS_TYPE_ARRAY:
 		return push_array;
 	case DBUS_TYPE_STRUCT:
@@ -0,0 +1,619 @@
+/*
+ * This file is part of lem-dbus.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-dbus is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-dbus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-dbus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AMALG
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include <lem.h>
+#include <dbus/dbus.h>
+
+#include "fd.h"
+#include "add.h"
+#include "push.h"
+
+#define EXPORT
+#endif
+
+#define LEM_DBUS_RING_META "lem.dbus.Ring"
+
+/*
+ * A ring is a single producer, single consumer queue of marshalled
+ * messages in a shared memfd. The consumer sleeps on an eventfd, which
+ * the producer only kicks when the consumer has announced that it is
+ * going to sleep, so a busy consumer drains any number of messages
+ * without a single syscall on either side.
+ *
+ * Each record is a 32bit length followed by a message as produced
+ * by dbus_message_marshal(). Positions are free running and masked
+ * into the data area, which must be a power of two in size.
+ */
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define LEM_DBUS_RING
+#endif
+
+struct ring_shared {
+	uint32_t head;    /* written by the producer */
+	uint32_t tail;    /* written by the consumer */
+	uint32_t waiting; /* consumer sleeps on the eventfd */
+	uint32_t closed;  /* producer has gone away */
+	uint32_t size;    /* size of the data area */
+};
+
+/* keep the data area cache line aligned */
+#define RING_HEADER  64
+#define RING_MINSIZE 4096
+#define RING_MAXSIZE (1U << 30)
+
+struct ring {
+	struct ev_io w;
+	lua_State *T;
+	struct ring_shared *shm;
+	unsigned char *data;
+	uint32_t size;
+	size_t mapsize;
+	int memfd;
+	int efd;
+	int producer;
+};
+
+static int
+ring_closed(lua_State *T)
+{
+	lua_pushnil(T);
+	lua_pushliteral(T, "closed");
+	return 2;
+}
+
+#ifdef LEM_DBUS_RING
+static int
+ring_error(lua_State *T, const char *msg)
+{
+	int err = errno;
+
+	lua_pushnil(T);
+	lua_pushfstring(T, "%s: %s", msg, strerror(err));
+	return 2;
+}
+
+static void
+ring_kick(struct ring *r)
+{
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&r->shm->waiting, 0, __ATOMIC_SEQ_CST))
+		(void)write(r->efd, &one, sizeof(one));
+}
+
+static void
+ring_copyin(struct ring *r, uint32_t pos, const void *src, uint32_t len)
+{
+	uint32_t off = pos & (r->size - 1);
+	uint32_t first = r->size - off;
+
+	if (first >= len)
+		memcpy(r->data + off, src, len);
+	else {
+		memcpy(r->data + off, src, first);
+		memcpy(r->data, (const unsigned char *)src + first, len - first);
+	}
+}
+
+static void
+ring_copyout(struct ring *r, uint32_t pos, void *dst, uint32_t len)
+{
+	uint32_t off = pos & (r->size - 1);
+	uint32_t first = r->size - off;
+
+	if (first >= len)
+		memcpy(dst, r->data + off, len);
+	else {
+		memcpy(dst, r->data + off, first);
+		memcpy((unsigned char *)dst + first, r->data, len - first);
+	}
+}
+
+/*
+ * Pops the next message and pushes its signature followed by its
+ * arguments. Returns the number of values pushed or -1 if the ring
+ * is empty.
+ */
+static int
+ring_pop(lua_State *T, struct ring *r)
+{
+	uint32_t tail = r->shm->tail;
+	uint32_t head = __atomic_load_n(&r->shm->head, __ATOMIC_SEQ_CST);
+	uint32_t used = head - tail;
+	uint32_t off;
+	uint32_t len;
+	DBusMessage *msg;
+	DBusError err;
+
+	if (used == 0)
+		return -1;
+
+	/* don't trust the peer further than the mapping goes */
+	if (used < sizeof(len) || used > r->size)
+		goto corrupt;
+	ring_copyout(r, tail, &len, sizeof(len));
+	if (len > used - sizeof(len))
+		goto corrupt;
+
+	dbus_error_init(&err);
+	off = (tail + sizeof(len)) & (r->size - 1);
+	if (off + len <= r->size) {
+		/* libdbus copies the data, so don't bother
+		 * unless the message wraps around */
+		msg = dbus_message_demarshal((const char *)r->data + off,
+		                             (int)len, &err);
+	} else {
+		char *buf = lem_xmalloc(len);
+
+		ring_copyout(r, tail + sizeof(len), buf, len);
+		msg = dbus_message_demarshal(buf, (int)len, &err);
+		free(buf);
+	}
+	__atomic_store_n(&r->shm->tail, tail + sizeof(len) + len,
+	                 __ATOMIC_RELEASE);
+
+	if (msg == NULL) {
+		lua_pushnil(T);
+		lua_pushstring(T, err.message);
+		dbus_error_free(&err);
+		return 2;
+	}
+
+	lua_pushstring(T, dbus_message_get_signature(msg));
+	len = lem_dbus_push_arguments(T, msg) + 1;
+	dbus_message_unref(msg);
+	return (int)len;
+
+corrupt:
+	lua_pushnil(T);
+	lua_pushliteral(T, "corrupt ring");
+	return 2;
+}
+
+static void
+ring_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct ring *r = (struct ring *)w;
+	lua_State *T = r->T;
+	uint64_t count;
+	int nargs;
+
+	(void)revents;
+
+	(void)read(r->efd, &count, sizeof(count));
+
+	nargs = ring_pop(T, r);
+	if (nargs < 0) {
+		if (!__atomic_load_n(&r->shm->closed, __ATOMIC_ACQUIRE)) {
+			/* spurious wakeup, go back to sleep */
+			__atomic_store_n(&r->shm->waiting, 1, __ATOMIC_SEQ_CST);
+			nargs = ring_pop(T, r);
+			if (nargs < 0)
+				return;
+		} else
+			nargs = ring_closed(T);
+	}
+
+	ev_io_stop(LEM_ &r->w);
+	r->T = NULL;
+	lem_queue(T, nargs);
+}
+
+static struct ring *
+ring_map(lua_State *T, int memfd, int efd, size_t mapsize, int producer)
+{
+	struct ring *r;
+	void *p;
+
+	p = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	r = lua_newuserdata(T, sizeof(struct ring));
+	ev_io_init(&r->w, ring_handler, efd, EV_READ);
+	r->T = NULL;
+	r->shm = p;
+	r->data = (unsigned char *)p + RING_HEADER;
+	r->size = 0;
+	r->mapsize = mapsize;
+	r->memfd = memfd;
+	r->efd = efd;
+	r->producer = producer;
+
+	luaL_getmetatable(T, LEM_DBUS_RING_META);
+	lua_setmetatable(T, -2);
+	return r;
+}
+#endif
+
+/*
+ * newring()
+ *
+ * argument 1: size of the data area (optional)
+ *
+ * Creates the producing end of a ring.
+ */
+EXPORT int
+lem_dbus_ring_new(lua_State *T)
+{
+#ifdef LEM_DBUS_RING
+	lua_Number want = luaL_optnumber(T, 1, 1 << 20);
+	uint32_t size = RING_MINSIZE;
+	size_t mapsize;
+	int memfd;
+	int efd;
+	struct ring *r;
+
+	luaL_argcheck(T, want <= RING_MAXSIZE, 1, "ring too big");
+	while (size < want)
+		size <<= 1;
+	mapsize = RING_HEADER + (size_t)size;
+
+	memfd = memfd_create("lem-dbus-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return ring_error(T, "error creating memfd");
+
+	if (ftruncate(memfd, (off_t)mapsize) ||
+	    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+		(void)close(memfd);
+		return ring_error(T, "error sizing memfd");
+	}
+
+	efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd < 0) {
+		(void)close(memfd);
+		return ring_error(T, "error creating eventfd");
+	}
+
+	r = ring_map(T, memfd, efd, mapsize, 1);
+	if (r == NULL) {
+		(void)close(memfd);
+		(void)close(efd);
+		return ring_error(T, "error mapping ring");
+	}
+
+	r->shm->size = size;
+	r->size = size;
+	return 1;
+#else
+	lua_pushnil(T);
+	lua_pushliteral(T, "rings not supported");
+	return 2;
+#endif
+}
+
+/*
+ * openring()
+ *
+ * argument 1: memfd
+ * argument 2: eventfd
+ *
+ * Attaches to the consuming end of a ring created by a peer.
+ * Both descriptors are duplicated, so the arguments may be
+ * closed afterwards.
+ */
+EXPORT int
+lem_dbus_ring_attach(lua_State *T)
+{
+#ifdef LEM_DBUS_RING
+	int memfd = lem_dbus_fd_get(T, 1);
+	int efd = lem_dbus_fd_get(T, 2);
+	int seals;
+	struct stat st;
+	struct ring *r;
+	uint32_t size;
+
+	if (memfd < 0 || efd < 0)
+		return ring_closed(T);
+
+	/* the peer must not be able to shrink the mapping */
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || (seals & F_SEAL_SHRINK) == 0 ||
+	    fstat(memfd, &st) || st.st_size <= RING_HEADER) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not a ring");
+		return 2;
+	}
+
+	efd = fcntl(efd, F_DUPFD_CLOEXEC, 0);
+	if (efd < 0)
+		return ring_error(T, "error duplicating eventfd");
+	(void)fcntl(efd, F_SETFL, fcntl(efd, F_GETFL) | O_NONBLOCK);
+
+	r = ring_map(T, memfd, efd, (size_t)st.st_size, 0);
+	if (r == NULL) {
+		(void)close(efd);
+		return ring_error(T, "error mapping ring");
+	}
+	/* the mapping keeps the memory alive */
+	r->memfd = -1;
+
+	size = r->shm->size;
+	r->size = size;
+	if (size < RING_MINSIZE || (size & (size - 1)) ||
+	    RING_HEADER + (size_t)size != r->mapsize) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not a ring");
+		return 2;
+	}
+
+	return 1;
+#else
+	lua_pushnil(T);
+	lua_pushliteral(T, "rings not supported");
+	return 2;
+#endif
+}
+
+static void
+ring_release(struct ring *r)
+{
+#ifdef LEM_DBUS_RING
+	if (r->shm == NULL)
+		return;
+
+	if (r->producer) {
+		__atomic_store_n(&r->shm->closed, 1, __ATOMIC_RELEASE);
+		ring_kick(r);
+	} else
+		ev_io_stop(LEM_ &r->w);
+
+	(void)munmap(r->shm, r->mapsize);
+	r->shm = NULL;
+	if (r->memfd >= 0)
+		(void)close(r->memfd);
+	(void)close(r->efd);
+#else
+	(void)r;
+#endif
+}
+
+/*
+ * Ring:__gc()
+ */
+static int
+ring_gc(lua_State *T)
+{
+	ring_release(lua_touserdata(T, 1));
+	return 0;
+}
+
+/*
+ * Ring:close()
+ *
+ * Closing the producing end makes the consumer
+ * return nil, 'closed' once the ring is drained.
+ */
+static int
+ring_close(lua_State *T)
+{
+	struct ring *r = luaL_checkudata(T, 1, LEM_DBUS_RING_META);
+	lua_State *S = r->T;
+
+	if (r->shm == NULL)
+		return ring_closed(T);
+
+	ring_release(r);
+
+	if (S) {
+		r->T = NULL;
+		lem_queue(S, ring_closed(S));
+	}
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * Ring:fds()
+ *
+ * Returns UnixFD objects for the memfd and eventfd
+ * of the producing end, ready to be passed to the peer.
+ */
+static int
+ring_fds(lua_State *T)
+{
+	struct ring *r = luaL_checkudata(T, 1, LEM_DBUS_RING_META);
+	int memfd;
+	int efd;
+
+	if (r->shm == NULL)
+		return ring_closed(T);
+	luaL_argcheck(T, r->producer, 1, "not the producing end");
+
+	memfd = fcntl(r->memfd, F_DUPFD_CLOEXEC, 0);
+	efd = fcntl(r->efd, F_DUPFD_CLOEXEC, 0);
+	if (memfd < 0 || efd < 0) {
+		if (memfd >= 0)
+			(void)close(memfd);
+		if (efd >= 0)
+			(void)close(efd);
+		lua_pushnil(T);
+		lua_pushliteral(T, "error duplicating file descriptors");
+		return 2;
+	}
+
+	lem_dbus_fd_push(T, memfd);
+	lem_dbus_fd_push(T, efd);
+	return 2;
+}
+
+/*
+ * Ring:send()
+ *
+ * argument 1: ring object
+ * argument 2: signature
+ * ...
+ *
+ * Returns nil, 'full' if there is no room for the message.
+ */
+static int
+ring_send(lua_State *T)
+{
+	struct ring *r = luaL_checkudata(T, 1, LEM_DBUS_RING_META);
+	const char *signature = luaL_optstring(T, 2, NULL);
+#ifdef LEM_DBUS_RING
+	DBusMessage *msg;
+	char *buf;
+	int len;
+	uint32_t head;
+	uint32_t used;
+
+	if (r->shm == NULL)
+		return ring_closed(T);
+	luaL_argcheck(T, r->producer, 1, "not the producing end");
+
+	msg = dbus_message_new_signal("/", "org.lem.dbus.Ring", "Message");
+	if (msg == NULL)
+		goto oom;
+
+	if (signature && signature[0] != '\0' &&
+	    lem_dbus_add_arguments(T, 3, signature, msg)) {
+		dbus_message_unref(msg);
+		return luaL_error(T, "%s", lua_tostring(T, -1));
+	}
+
+	if (dbus_message_contains_unix_fds(msg)) {
+		dbus_message_unref(msg);
+		return luaL_error(T, "file descriptors can't be sent over rings");
+	}
+
+	dbus_message_set_serial(msg, 1);
+	if (!dbus_message_marshal(msg, &buf, &len)) {
+		dbus_message_unref(msg);
+		goto oom;
+	}
+	dbus_message_unref(msg);
+
+	head = r->shm->head;
+	used = head - __atomic_load_n(&r->shm->tail, __ATOMIC_ACQUIRE);
+	if (used > r->size ||
+	    (size_t)len + sizeof(uint32_t) > r->size - used) {
+		dbus_free(buf);
+		lua_pushnil(T);
+		lua_pushliteral(T, "full");
+		return 2;
+	}
+
+	ring_copyin(r, head, &len, sizeof(uint32_t));
+	ring_copyin(r, head + sizeof(uint32_t), buf, (uint32_t)len);
+	dbus_free(buf);
+
+	__atomic_store_n(&r->shm->head, head + sizeof(uint32_t) + (uint32_t)len,
+	                 __ATOMIC_SEQ_CST);
+	ring_kick(r);
+
+	lua_pushboolean(T, 1);
+	return 1;
+
+oom:
+	lua_pushnil(T);
+	lua_pushliteral(T, "out of memory");
+	return 2;
+#else
+	(void)r;
+	(void)signature;
+	return ring_closed(T);
+#endif
+}
+
+/*
+ * Ring:receive()
+ *
+ * Returns the signature and arguments of the next message,
+ * waiting for one if the ring is empty.
+ */
+static int
+ring_receive(lua_State *T)
+{
+	struct ring *r = luaL_checkudata(T, 1, LEM_DBUS_RING_META);
+#ifdef LEM_DBUS_RING
+	int nargs;
+
+	if (r->shm == NULL)
+		return ring_closed(T);
+	luaL_argcheck(T, !r->producer, 1, "not the consuming end");
+
+	if (r->T != NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	nargs = ring_pop(T, r);
+	if (nargs >= 0)
+		return nargs;
+
+	if (__atomic_load_n(&r->shm->closed, __ATOMIC_ACQUIRE))
+		return ring_closed(T);
+
+	/* announce that we're going to sleep and check again,
+	 * or we might miss a message sent in between */
+	__atomic_store_n(&r->shm->waiting, 1, __ATOMIC_SEQ_CST);
+	nargs = ring_pop(T, r);
+	if (nargs >= 0)
+		return nargs;
+
+	r->T = T;
+	ev_io_start(LEM_ &r->w);
+	return lua_yield(T, 0);
+#else
+	(void)r;
+	return ring_closed(T);
+#endif
+}
+
+/*
+ * Creates the Ring metatable, registers it and leaves
+ * it on top of the stack.
+ */
+EXPORT void
+lem_dbus_ring_open(lua_State *L)
+{
+	luaL_Reg ring_funcs[] = {
+		{ "__gc",    ring_gc },
+		{ "close",   ring_close },
+		{ "fds",     ring_fds },
+		{ "send",    ring_send },
+		{ "receive", ring_receive },
+		{ NULL,      NULL }
+	};
+	luaL_Reg *p;
+
+	luaL_newmetatable(L, LEM_DBUS_RING_META);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+
+	for (p = ring_funcs; p->name; p++) {
+		lua_pushcfunction(L, p->func);
+		lua_setfield(L, -2, p->name);
+	}
+}